@@ -0,0 +1,241 @@
+#include <iostream>
+#include <memory>
+#include <cmath>
+#include <string>
+#include <unordered_map>
+#include <complex>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <atomic>
+#include <cstdio>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <sys/resource.h>
+#include "symbolic.hpp"
+#include "parser.hpp"
+#include "incremental.hpp"
+
+// Benchmarks parse, differentiate, eval, substitute and to_string over
+// generated expressions of controlled size and shape, for double and
+// std::complex<double>, plus IncrementalEvaluator after a change of x.
+// Every measurement is one JSON object per line:
+//
+//   {"shape":"random","type":"double","nodes":N,"depth":D,"op":"parse",
+//    "runs":R,"ns":best,"ns_per_node":..,"allocations":..,"bytes":..,
+//    "peak_bytes":..}
+//
+// ns is the fastest of R runs; allocations, bytes and peak_bytes are heap
+// operator new calls, bytes requested and the high-water mark of live heap
+// bytes above the starting level during one run. The last line reports the
+// process peak RSS. Pass --quick for small sizes only.
+
+namespace {
+    std::atomic<size_t> allocation_count{ 0 };
+    std::atomic<size_t> allocated_bytes{ 0 };
+    std::atomic<size_t> live_bytes{ 0 };
+    std::atomic<size_t> peak_live_bytes{ 0 };
+
+    // Every block carries its size in front so delete can account for it.
+    constexpr size_t header_size = alignof(std::max_align_t);
+
+    void* counted_allocate(size_t size) {
+        void* block = std::malloc(size + header_size);
+        if (!block)
+            throw std::bad_alloc();
+        *static_cast<size_t*>(block) = size;
+        allocation_count.fetch_add(1, std::memory_order_relaxed);
+        allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+        size_t live = live_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+        size_t peak = peak_live_bytes.load(std::memory_order_relaxed);
+        while (live > peak && !peak_live_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
+        return static_cast<char*>(block) + header_size;
+    }
+    void counted_free(void* pointer) {
+        if (!pointer)
+            return;
+        void* block = static_cast<char*>(pointer) - header_size;
+        live_bytes.fetch_sub(*static_cast<size_t*>(block), std::memory_order_relaxed);
+        std::free(block);
+    }
+}
+
+void* operator new(size_t size) {
+    return counted_allocate(size);
+}
+void* operator new[](size_t size) {
+    return counted_allocate(size);
+}
+void operator delete(void* pointer) noexcept {
+    counted_free(pointer);
+}
+void operator delete[](void* pointer) noexcept {
+    counted_free(pointer);
+}
+void operator delete(void* pointer, size_t) noexcept {
+    counted_free(pointer);
+}
+void operator delete[](void* pointer, size_t) noexcept {
+    counted_free(pointer);
+}
+
+// Postfix source of a generated expression with its node count and depth.
+struct Generated {
+    std::string source;
+    size_t nodes = 0;
+    size_t depth = 0;
+};
+
+class Generator {
+public:
+    explicit Generator(std::uint64_t seed)
+        : random(seed) {}
+
+    // Random tree of about `nodes` nodes over x, y, z and small constants;
+    // subtree sizes are split at random, so the depth is O(log nodes) on average.
+    Generated random_tree(size_t nodes) {
+        Generated result;
+        result.depth = random_subtree(nodes, result.source);
+        result.nodes = count(result.source);
+        return result;
+    }
+    // x op (y op (x op ...)), the right-nested chain that is worst for
+    // recursion depth and for POW/DIV derivative growth.
+    Generated chain(const char* op, size_t length) {
+        Generated result;
+        for (size_t i = 0; i < length; i++)
+            result.source += i % 2 ? "y " : "x ";
+        result.source += "x";
+        for (size_t i = 0; i < length; i++)
+            (result.source += ' ') += op;
+        result.nodes = 2 * length + 1;
+        result.depth = length + 1;
+        return result;
+    }
+private:
+    std::mt19937_64 random;
+
+    static size_t count(const std::string& source) {
+        size_t tokens = 0;
+        bool in_token = false;
+        for (char c : source) {
+            if (c != ' ' && !in_token)
+                tokens++;
+            in_token = c != ' ';
+        }
+        return tokens;
+    }
+    size_t random_subtree(size_t nodes, std::string& out) {
+        static const char* leaves[] = { "x", "y", "z", "0.5", "1.25", "2" };
+        static const char* unary[] = { "sin", "cos", "exp", "ln" };
+        static const char* binary[] = { "+", "-", "*", "/", "^", "+", "*" };
+        if (!out.empty())
+            out += ' ';
+        if (nodes <= 1) {
+            out += leaves[random() % 6];
+            return 1;
+        }
+        if (nodes == 2 || random() % 5 == 0) {
+            size_t depth = random_subtree(nodes - 1, out);
+            (out += ' ') += unary[random() % 4];
+            return depth + 1;
+        }
+        size_t left = 1 + random() % (nodes - 2);
+        size_t depth_left = random_subtree(left, out);
+        size_t depth_right = random_subtree(nodes - 1 - left, out);
+        (out += ' ') += binary[random() % 7];
+        return std::max(depth_left, depth_right) + 1;
+    }
+};
+
+struct Measurement {
+    size_t runs = 0;
+    double ns = 0;
+    size_t allocations = 0;
+    size_t bytes = 0;
+    size_t peak_bytes = 0;
+};
+
+// Runs f until it has taken at least min_total or max_runs runs; the
+// allocation counters describe the last run.
+template <typename F>
+Measurement measure(F f) {
+    using clock = std::chrono::steady_clock;
+    constexpr double min_total = 2e8;
+    constexpr size_t min_runs = 3, max_runs = 1000;
+    Measurement m;
+    double total = 0;
+    m.ns = 1e300;
+    while (m.runs < min_runs || (total < min_total && m.runs < max_runs)) {
+        size_t allocations = allocation_count.load();
+        size_t bytes = allocated_bytes.load();
+        size_t base = live_bytes.load();
+        peak_live_bytes.store(base);
+        auto start = clock::now();
+        f();
+        double ns = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+        m.allocations = allocation_count.load() - allocations;
+        m.bytes = allocated_bytes.load() - bytes;
+        m.peak_bytes = peak_live_bytes.load() - base;
+        m.ns = std::min(m.ns, ns);
+        total += ns;
+        m.runs++;
+    }
+    return m;
+}
+
+void report(const char* shape, const char* type, const Generated& g, const char* op, const Measurement& m) {
+    std::printf("{\"shape\":\"%s\",\"type\":\"%s\",\"nodes\":%zu,\"depth\":%zu,\"op\":\"%s\",\"runs\":%zu,\"ns\":%.0f,\"ns_per_node\":%.3f,\"allocations\":%zu,\"bytes\":%zu,\"peak_bytes\":%zu}\n",
+        shape, type, g.nodes, g.depth, op, m.runs, m.ns, m.ns / g.nodes, m.allocations, m.bytes, m.peak_bytes);
+    std::fflush(stdout);
+}
+
+template <typename T>
+void run(const char* shape, const char* type, const Generated& g) {
+    Parser<T> parser;
+    std::shared_ptr<Expression<T>> expr;
+    report(shape, type, g, "parse", measure([&] { expr = parser.parse(g.source); }));
+    expr = parser.parse(g.source);
+    report(shape, type, g, "differentiate", measure([&] { expr->differentiate("x"); }));
+    Environment<T> env;
+    env.set("x", T(0.75));
+    env.set("y", T(1.5));
+    env.set("z", T(0.25));
+    volatile bool sink = false;
+    report(shape, type, g, "eval", measure([&] { sink = expr->eval(env) == T(0); }));
+    IncrementalEvaluator<T> incremental(*expr);
+    incremental.set(env);
+    T x = T(0.75);
+    report(shape, type, g, "eval_incremental", measure([&] {
+        x = x == T(0.75) ? T(0.5) : T(0.75);
+        incremental.set("x", x);
+        sink = incremental.eval() == T(0);
+    }));
+    report(shape, type, g, "substitute", measure([&] { expr->substitute("x", T(0.75)); }));
+    report(shape, type, g, "to_string", measure([&] { sink = expr->to_string().empty(); }));
+}
+
+int main(int argc, char** argv) {
+    bool quick = argc > 1 && std::string(argv[1]) == "--quick";
+    std::vector<size_t> random_sizes = quick ? std::vector<size_t>{ 1000 } : std::vector<size_t>{ 1000, 10000, 100000 };
+    std::vector<size_t> chain_lengths = quick ? std::vector<size_t>{ 100 } : std::vector<size_t>{ 100, 1000, 5000, 100000 };
+    Generator generator(20240601);
+    for (size_t size : random_sizes) {
+        Generated g = generator.random_tree(size);
+        run<double>("random", "double", g);
+        run<std::complex<double>>("random", "complex", g);
+    }
+    for (const char* op : { "^", "/" }) {
+        std::string shape = std::string(op[0] == '^' ? "pow" : "div") + "_chain";
+        for (size_t length : chain_lengths) {
+            Generated g = generator.chain(op, length);
+            run<double>(shape.c_str(), "double", g);
+            run<std::complex<double>>(shape.c_str(), "complex", g);
+        }
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::printf("{\"max_rss_kb\":%ld}\n", usage.ru_maxrss);
+    return 0;
+}
@@ -4,163 +4,783 @@
 #include <string>
 #include <unordered_map>
 #include <complex>
-#include <stack>
+#include <vector>
+#include <sstream>
+#include <string_view>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <deque>
+#include <thread>
+#include <fstream>
+#include <optional>
 #include "symbolic.hpp"
+#include "parallel.hpp"
+#include "parser.hpp"
+#include "serialize.hpp"
 
-double parse_number_real(const std::string& source) {
-    if (source.empty()) {
-        throw std::runtime_error("Number cannot be empty");
-    }
-    try {
-        return (source.front() == '.') ? std::stod("0" + source) : std::stod(source);
-    }
-    catch(std::exception) {
-        throw std::runtime_error("Wrong number format: " + source);
-    }
-}
-std::complex<double> parse_number_complex(const std::string& source) {
-    std::string copy = source;
-    if (copy.empty()) {
-        throw std::runtime_error("Number cannot be empty");
-    }
-    bool complex_flag = source.back() == 'i';
-    if (complex_flag)
-        copy.pop_back();
-    size_t op_position = copy.size();
-    for (size_t ptr = 1; ptr < copy.size(); ptr++) {
-        if (copy[ptr] == '+' || copy[ptr] == '-') {
-            op_position = ptr;
-            break;
-        }
-    }
-    if (op_position == copy.size() && complex_flag)
-        return std::complex<double>(0, parse_number_real(copy));
-    if (op_position == copy.size() && !complex_flag)
-        return std::complex<double>(parse_number_real(copy), 0);
-    if (op_position != copy.size() && complex_flag)
-        return std::complex<double>(parse_number_real(copy.substr(0, op_position)), parse_number_real(copy.substr(op_position + 1)));
-    throw std::runtime_error("Cannot create complex number without an operation");
-}
-
-std::shared_ptr<Expression<std::complex<double>>> parse(const std::string& source) {
-    std::stringstream ss(source);
-    std::string field;
-    std::vector<std::string> split;
-    while (true) {
-        if (ss >> field)
-            split.push_back(field);
-        else if (ss.eof())
-            break;
-    }
-    ss.clear();
-    std::stack<std::shared_ptr<Expression<std::complex<double>>>> rpn;
-    for (std::string lexem : split) {
-        if (std::isdigit(lexem.front()) || lexem.front() == '.')
-        {
-            rpn.push(ConstExpression<std::complex<double>>(parse_number_complex(lexem)).clone());
+std::shared_ptr<Expression<std::complex<double>>> parse(std::string_view source, Notation notation) {
+    return Parser<std::complex<double>>(notation).parse(source);
+}
+
+// The same expression over a real type, or nullptr when one of its
+// constants has an imaginary part. Shared subtrees stay shared.
+template <typename R>
+std::shared_ptr<Expression<R>> real_expression(const std::shared_ptr<Expression<std::complex<double>>>& expr) {
+    using C = std::complex<double>;
+    ExpressionFactory<R> factory(false);
+    std::unordered_map<const Expression<C>*, std::shared_ptr<Expression<R>>> converted;
+    std::vector<std::pair<const Expression<C>*, bool>> stack{ { expr.get(), false } };
+    while (!stack.empty()) {
+        auto [e, expanded] = stack.back();
+        if (converted.count(e)) {
+            stack.pop_back();
             continue;
         }
-        if (lexem == "+") {
-            auto y = rpn.top(); rpn.pop();
-            rpn.top() = (*rpn.top() + *y).clone();
+        auto unary = dynamic_cast<const UnaryOperationExpression<C>*>(e);
+        auto binary = dynamic_cast<const BinaryOperationExpression<C>*>(e);
+        if (!expanded && (unary || binary)) {
+            stack.back().second = true;
+            if (unary)
+                stack.push_back({ unary->operand.get(), false });
+            else {
+                stack.push_back({ binary->operand_right.get(), false });
+                stack.push_back({ binary->operand_left.get(), false });
+            }
             continue;
         }
-        if (lexem == "-") {
-            auto y = rpn.top(); rpn.pop();
-            rpn.top() = (*rpn.top() - *y).clone();
-            continue;
+        stack.pop_back();
+        std::shared_ptr<Expression<R>> result;
+        if (auto c = dynamic_cast<const ConstExpression<C>*>(e)) {
+            if (c->value.imag() != 0)
+                return nullptr;
+            result = factory.constant(static_cast<R>(c->value.real()));
         }
-        if (lexem == "*") {
-            auto y = rpn.top(); rpn.pop();
-            rpn.top() = (*rpn.top() * *y).clone();
-            continue;
+        else if (auto v = dynamic_cast<const VariableExpression<C>*>(e))
+            result = factory.variable(v->name);
+        else if (unary)
+            result = factory.unary(static_cast<typename UnaryOperationExpression<R>::Type>(unary->type), converted.at(unary->operand.get()));
+        else if (binary)
+            result = factory.binary(static_cast<typename BinaryOperationExpression<R>::Type>(binary->type), converted.at(binary->operand_left.get()), converted.at(binary->operand_right.get()));
+        else
+            throw std::runtime_error("Unknown expression type");
+        converted.emplace(e, result);
+    }
+    return converted.at(expr.get());
+}
+
+// Which instantiation --eval, --grad and --batch run real inputs through.
+enum class Domain { DOUBLE, FLOAT, COMPLEX };
+
+template <typename R>
+bool real_bindings(const std::unordered_map<std::string, std::complex<double>>& env, std::unordered_map<std::string, R>& out) {
+    for (const auto& binding : env) {
+        if (binding.second.imag() != 0)
+            return false;
+        out[binding.first] = static_cast<R>(binding.second.real());
+    }
+    return true;
+}
+
+// Value (and partials) computed in R, or nothing when the input is not real
+// or the result is not finite, e.g. the log of a negative number; the caller
+// then evaluates in complex. Elementary<T> makes both agree on real data.
+template <typename R>
+std::optional<std::complex<double>> eval_real(const std::shared_ptr<Expression<std::complex<double>>>& expr, const std::unordered_map<std::string, std::complex<double>>& env) {
+    std::unordered_map<std::string, R> real_env;
+    if (!real_bindings(env, real_env))
+        return std::nullopt;
+    auto real = real_expression<R>(expr);
+    if (!real)
+        return std::nullopt;
+    R value = real->eval(real_env);
+    if (!std::isfinite(value))
+        return std::nullopt;
+    return std::complex<double>(value);
+}
+template <typename R>
+std::optional<std::complex<double>> gradient_real(const std::shared_ptr<Expression<std::complex<double>>>& expr, const std::unordered_map<std::string, std::complex<double>>& env, std::unordered_map<std::string, std::complex<double>>& partials) {
+    std::unordered_map<std::string, R> real_env;
+    if (!real_bindings(env, real_env))
+        return std::nullopt;
+    auto real = real_expression<R>(expr);
+    if (!real)
+        return std::nullopt;
+    std::unordered_map<std::string, R> real_partials;
+    R value = real->gradient(real_env, real_partials);
+    if (!std::isfinite(value))
+        return std::nullopt;
+    for (const auto& partial : real_partials)
+        if (!std::isfinite(partial.second))
+            return std::nullopt;
+    for (const auto& partial : real_partials)
+        partials[partial.first] = partial.second;
+    return std::complex<double>(value);
+}
+std::complex<double> eval_value(const std::shared_ptr<Expression<std::complex<double>>>& expr, const std::unordered_map<std::string, std::complex<double>>& env, Domain domain) {
+    std::optional<std::complex<double>> value;
+    if (domain == Domain::DOUBLE)
+        value = eval_real<double>(expr, env);
+    else if (domain == Domain::FLOAT)
+        value = eval_real<float>(expr, env);
+    return value ? *value : expr->eval(env);
+}
+std::complex<double> gradient_value(const std::shared_ptr<Expression<std::complex<double>>>& expr, const std::unordered_map<std::string, std::complex<double>>& env, std::unordered_map<std::string, std::complex<double>>& partials, Domain domain) {
+    std::optional<std::complex<double>> value;
+    if (domain == Domain::DOUBLE)
+        value = gradient_real<double>(expr, env, partials);
+    else if (domain == Domain::FLOAT)
+        value = gradient_real<float>(expr, env, partials);
+    return value ? *value : expr->gradient(env, partials);
+}
+// Prints a zero imaginary part as 0 rather than -0, whichever path produced it.
+std::complex<double> printable(std::complex<double> value) {
+    return std::complex<double>(value.real(), value.imag() + 0.0);
+}
+
+int fail(std::string s) {
+    std::cout << "Usage:\n";
+    std::cout << s << " --diff \"[expression]\" --by [variable][,variable...] [--simplify] [--threads N]\n";
+    std::cout << s << " --hessian \"[expression]\" --by [variable],[variable]... [--simplify]\n";
+    std::cout << s << " --eval \"[expression]\" [variable]=[value] ... [--float|--complex]\n";
+    std::cout << s << " --grad \"[expression]\" [variable]=[value] ... [--float|--complex]\n";
+    std::cout << s << " --batch [file] [--simplify] [--threads N] [--complex]\n";
+    std::cout << s << " --parse [file] [--save file]\n";
+    std::cout << s << " \"[expression]\" [--simplify] [--save file]\n";
+    std::cout << "    --threads N runs N workers, 1 to 256; 0 uses one per core\n";
+    std::cout << "    real inputs are evaluated in double (in float with --float) unless --complex is given\n";
+    std::cout << "    --stats writes node, allocation, phase and tree size statistics to stderr as JSON\n";
+    std::cout << "    --save stores the result (or the derivatives of --diff) in binary form;\n";
+    std::cout << "    --load file replaces the [expression] argument with the stored expressions\n";
+    std::cout << "    expressions are postfix; pass --infix for infix notation, e.g. \"sin(x*y) + x^2\"\n";
+    std::cout << "    one job per line: eval|grad<TAB>[expression]<TAB>[variable]=[value] ...\n";
+    std::cout << "                      diff<TAB>[expression]<TAB>[variable]\n";
+    return 0;
+}
+
+// Job runner for --batch. Every distinct expression is parsed and compiled
+// once per runner; derivative text is cached per variable. Unless real is
+// false, eval and grad jobs with real constants and bindings run on a double
+// tape, falling back to complex when a result is not finite. One runner must
+// not be used by two threads at once.
+class BatchRunner {
+public:
+    BatchRunner(bool simplify, Notation notation, bool real = true)
+        : simplify(simplify), real(real), parser(notation) {}
+    // Appends the result line of one job to out.
+    void run(std::string_view line, std::string& out) {
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        if (line.empty())
+            return;
+        try {
+            process(line, out);
         }
-        if (lexem == "/") {
-            auto y = rpn.top(); rpn.pop();
-            rpn.top() = (*rpn.top() / *y).clone();
-            continue;
+        catch (const std::exception& e) {
+            out += "error: ";
+            out += e.what();
         }
-        if (lexem == "/") {
-            auto y = rpn.top(); rpn.pop();
-            rpn.top() = (*rpn.top() / *y).clone();
-            continue;
+        out += '\n';
+    }
+private:
+    using C = std::complex<double>;
+    struct Entry {
+        std::shared_ptr<Expression<C>> expr;
+        CompiledExpression<C> compiled;
+        std::optional<CompiledExpression<double>> real; // same slot order as compiled
+        std::unordered_map<std::string, std::string> derivatives;
+    };
+    bool simplify;
+    bool real;
+    Parser<C> parser;
+    std::string key;
+    std::unordered_map<std::string, Entry> cache;
+    std::vector<C> slots;
+    std::vector<bool> bound;
+    std::vector<C> partials;
+    std::vector<double> real_slots;
+    std::vector<double> real_partials;
+
+    static std::string_view next_field(std::string_view& line) {
+        size_t tab = line.find('\t');
+        std::string_view field = line.substr(0, tab);
+        line.remove_prefix(tab == std::string_view::npos ? line.size() : tab + 1);
+        return field;
+    }
+    Entry& lookup(std::string_view source) {
+        key.assign(source.data(), source.size());
+        auto it = cache.find(key);
+        if (it != cache.end())
+            return it->second;
+        auto expr = parser.parse(key);
+        Entry entry{ expr, expr->compile(), std::nullopt, {} };
+        if (real)
+            if (auto real_expr = real_expression<double>(expr))
+                entry.real = real_expr->compile();
+        return cache.emplace(key, std::move(entry)).first->second;
+    }
+    // Fills slots in the tape's order from "name=value name=value ...".
+    void bind(const CompiledExpression<C>& compiled, std::string_view bindings) {
+        slots.assign(compiled.variables.size(), C());
+        bound.assign(compiled.variables.size(), false);
+        while (!bindings.empty()) {
+            size_t space = bindings.find(' ');
+            std::string_view binding = bindings.substr(0, space);
+            bindings.remove_prefix(space == std::string_view::npos ? bindings.size() : space + 1);
+            if (binding.empty())
+                continue;
+            size_t eq = binding.find('=');
+            if (eq == std::string_view::npos)
+                throw std::runtime_error("Expected [variable]=[value]: " + std::string(binding));
+            std::string_view name = binding.substr(0, eq);
+            for (size_t i = 0; i < compiled.variables.size(); i++) {
+                if (compiled.variables[i] == name) {
+                    slots[i] = parse_number_complex(binding.substr(eq + 1));
+                    bound[i] = true;
+                }
+            }
         }
-        if (lexem == "^") {
-            auto y = rpn.top(); rpn.pop();
-            rpn.top() = (*rpn.top() ^ *y).clone();
-            continue;
+        for (size_t i = 0; i < bound.size(); i++)
+            if (!bound[i])
+                throw std::runtime_error("Unknown variable: " + compiled.variables[i]);
+    }
+    static void append(std::string& out, C value) {
+        value = printable(value);
+        char buffer[64];
+        int n = std::snprintf(buffer, sizeof(buffer), "(%g,%g)", value.real(), value.imag());
+        out.append(buffer, n);
+    }
+    // Copies the bound slots to real_slots if they are all real.
+    bool real_binding(const Entry& entry) {
+        if (!entry.real)
+            return false;
+        real_slots.resize(slots.size());
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (slots[i].imag() != 0)
+                return false;
+            real_slots[i] = slots[i].real();
         }
-        if (lexem == "sin") {
-            rpn.top() = Expression<std::complex<double>>::sin(*rpn.top()).clone();
-            continue;
+        return true;
+    }
+    bool real_gradient(const Entry& entry, C& value) {
+        real_partials.resize(real_slots.size());
+        double real_value = entry.real->gradient(real_slots.data(), real_partials.data());
+        if (!std::isfinite(real_value))
+            return false;
+        for (double partial : real_partials)
+            if (!std::isfinite(partial))
+                return false;
+        value = real_value;
+        return true;
+    }
+    void process(std::string_view line, std::string& out) {
+        std::string_view operation = next_field(line);
+        std::string_view source = next_field(line);
+        std::string_view arguments = line;
+        Entry& entry = lookup(source);
+        if (operation == "eval") {
+            bind(entry.compiled, arguments);
+            if (real_binding(entry)) {
+                double value = entry.real->eval(real_slots.data());
+                if (std::isfinite(value)) {
+                    append(out, value);
+                    return;
+                }
+            }
+            append(out, entry.compiled.eval(slots.data()));
         }
-        if (lexem == "cos") {
-            rpn.top() = Expression<std::complex<double>>::cos(*rpn.top()).clone();
-            continue;
+        else if (operation == "grad") {
+            bind(entry.compiled, arguments);
+            partials.resize(slots.size());
+            C value;
+            if (real_binding(entry) && real_gradient(entry, value))
+                std::copy(real_partials.begin(), real_partials.end(), partials.begin());
+            else
+                value = entry.compiled.gradient(slots.data(), partials.data());
+            append(out, value);
+            for (size_t i = 0; i < partials.size(); i++) {
+                out += ' ';
+                out += entry.compiled.variables[i];
+                out += '=';
+                append(out, partials[i]);
+            }
         }
-        if (lexem == "ln") {
-            rpn.top() = Expression<std::complex<double>>::ln(*rpn.top()).clone();
-            continue;
+        else if (operation == "diff") {
+            std::string variable(arguments);
+            auto it = entry.derivatives.find(variable);
+            if (it == entry.derivatives.end()) {
+                std::shared_ptr<Expression<C>> diff = entry.expr->differentiate(variable);
+                if (simplify)
+                    diff = diff->simplify();
+                it = entry.derivatives.emplace(variable, diff->to_string()).first;
+            }
+            out += it->second;
         }
-        if (lexem == "exp") {
-            rpn.top() = Expression<std::complex<double>>::exp(*rpn.top()).clone();
-            continue;
+        else
+            throw std::runtime_error("Unknown operation: " + std::string(operation));
+    }
+};
+
+// Feeds jobs to runners and writes their results in input order. With more
+// than one thread, lines are collected into blocks and each block is split
+// into chunks that run concurrently, one runner (and expression cache) per
+// worker.
+class BatchWriter {
+public:
+    BatchWriter(bool simplify, Notation notation, size_t threads, bool real = true) {
+        if (threads > 1)
+            pool = std::make_unique<ThreadPool>(threads);
+        runners.resize(pool ? pool->size() + 1 : 1, BatchRunner(simplify, notation, real));
+    }
+    ~BatchWriter() {
+        finish();
+    }
+    void push(std::string_view line) {
+        if (!pool) {
+            runners[0].run(line, out);
+            if (out.size() >= flush_size)
+                flush();
+            return;
         }
-        rpn.push(VariableExpression<std::complex<double>>(lexem).clone());
+        lines.push_back(line);
+        if (lines.size() == block_lines)
+            run_block();
+    }
+    // Lines pushed but not run yet; they must stay alive until then.
+    size_t buffered() const {
+        return lines.size();
     }
-    return rpn.top();
+    void finish() {
+        if (pool && !lines.empty())
+            run_block();
+        flush();
+    }
+private:
+    static constexpr size_t flush_size = 1 << 16;
+    static constexpr size_t block_lines = 1 << 16;
+    static constexpr size_t chunk_lines = 1 << 10;
+    std::unique_ptr<ThreadPool> pool;
+    std::vector<BatchRunner> runners;
+    std::vector<std::string_view> lines;
+    std::string out;
+
+    void run_block() {
+        size_t chunks = (lines.size() + chunk_lines - 1) / chunk_lines;
+        std::vector<std::string> results(chunks);
+        parallel_for(*pool, 0, chunks, 1, [&](size_t begin, size_t end) {
+            BatchRunner& runner = runners[pool->current_index()];
+            for (size_t chunk = begin; chunk < end; chunk++) {
+                size_t last = std::min(lines.size(), (chunk + 1) * chunk_lines);
+                for (size_t i = chunk * chunk_lines; i < last; i++)
+                    runner.run(lines[i], results[chunk]);
+            }
+        });
+        lines.clear();
+        for (const std::string& result : results)
+            std::fwrite(result.data(), 1, result.size(), stdout);
+    }
+    void flush() {
+        std::fwrite(out.data(), 1, out.size(), stdout);
+        out.clear();
+    }
+};
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Cannot open " + path);
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            throw std::runtime_error("Cannot stat " + path);
+        }
+        size = static_cast<size_t>(info.st_size);
+        if (size != 0)
+            mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+            throw std::runtime_error("Cannot map " + path);
+        if (size != 0)
+            madvise(mapping, size, MADV_SEQUENTIAL);
+    }
+    ~MappedFile() {
+        if (size != 0)
+            munmap(mapping, size);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    std::string_view data() const {
+        return size == 0 ? std::string_view() : std::string_view(static_cast<const char*>(mapping), size);
+    }
+private:
+    void* mapping = nullptr;
+    size_t size = 0;
+};
+
+// Runs jobs from a memory-mapped file, or from stdin when path is empty.
+int run_batch(const std::string& path, bool simplify, Notation notation, size_t threads, bool real) {
+    BatchWriter writer(simplify, notation, threads, real);
+    if (path.empty()) {
+        std::ios::sync_with_stdio(false);
+        // Stable storage for the lines the writer has not run yet.
+        std::deque<std::string> block;
+        std::string line;
+        while (std::getline(std::cin, line)) {
+            block.push_back(std::move(line));
+            writer.push(block.back());
+            if (writer.buffered() == 0)
+                block.clear();
+        }
+        writer.finish();
+        return 0;
+    }
+    try {
+        MappedFile file(path);
+        std::string_view data = file.data();
+        while (!data.empty()) {
+            size_t newline = data.find('\n');
+            writer.push(data.substr(0, newline));
+            data.remove_prefix(newline == std::string_view::npos ? data.size() : newline + 1);
+        }
+        writer.finish();
+    }
+    catch (const std::runtime_error& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+    return 0;
 }
 
-int fail(std::string s) {
-    std::cout << "Usage:\n";
-    std::cout << s << " --diff \"[expression]\" --by [variable]\n";
-    std::cout << s << " --eval \"[expression]\" --by [variable]=[value]\n";
+// Shapes of the trees each step produced, for --stats.
+bool stats = false;
+std::vector<std::pair<const char*, ExpressionShape>> shapes;
+
+void record_shape(const char* step, const std::vector<std::shared_ptr<Expression<std::complex<double>>>>& exprs) {
+    if (stats)
+        shapes.emplace_back(step, expression_shape(exprs));
+}
+
+void print_stats(std::ostream& out) {
+    out << "{\"instrumented\":" << (Statistics::enabled ? "true" : "false") << ",\"counters\":{";
+    for (int i = 0; i < Statistics::COUNTERS; i++) {
+        Statistics::Counter counter = static_cast<Statistics::Counter>(i);
+        out << (i ? "," : "") << '"' << Statistics::name(counter) << "\":" << Statistics::get(counter);
+    }
+    out << "},\"phases\":[";
+    std::vector<Statistics::PhaseTotal> phases = Statistics::phases();
+    for (size_t i = 0; i < phases.size(); i++)
+        out << (i ? "," : "") << "{\"name\":\"" << phases[i].name << "\",\"calls\":" << phases[i].calls << ",\"seconds\":" << phases[i].seconds << '}';
+    out << "],\"trees\":[";
+    for (size_t i = 0; i < shapes.size(); i++) {
+        const ExpressionShape& shape = shapes[i].second;
+        out << (i ? "," : "") << "{\"step\":\"" << shapes[i].first << "\",\"size\":" << shape.size << ",\"distinct\":" << shape.distinct << ",\"depth\":" << shape.depth << '}';
+    }
+    out << "]}\n";
+}
+
+// Expressions stored with --save; the file is mapped, not read.
+std::vector<std::shared_ptr<Expression<std::complex<double>>>> load_expressions(const std::string& path) {
+    MappedFile file(path);
+    return deserialize<std::complex<double>>(file.data());
+}
+int save_expressions(const std::string& path, const std::vector<std::shared_ptr<Expression<std::complex<double>>>>& exprs) {
+    Statistics::Phase phase("save");
+    std::ofstream out(path, std::ios::binary);
+    out << serialize(exprs);
+    if (!out) {
+        std::cerr << "Cannot write " << path << '\n';
+        return 1;
+    }
     return 0;
 }
 
-int main(int argc, char** argv) {
+// The expressions stored at path, or the one parsed from source when path is empty.
+std::vector<std::shared_ptr<Expression<std::complex<double>>>> read_expressions(const std::string& path, std::string_view source, Notation notation) {
+    std::vector<std::shared_ptr<Expression<std::complex<double>>>> exprs;
+    if (!path.empty()) {
+        Statistics::Phase phase("load");
+        exprs = load_expressions(path);
+    }
+    else {
+        Statistics::Phase phase("parse");
+        exprs.push_back(parse(source, notation));
+    }
+    record_shape("input", exprs);
+    return exprs;
+}
+
+// Parses one expression from a file (or stdin) and reports throughput;
+// with --save the parsed tree is stored as well.
+int run_parse(const std::string& path, Notation notation, const std::string& save_path) {
     std::string input;
-    std::string by;
+    std::unique_ptr<MappedFile> file;
+    std::string_view source;
+    try {
+        if (path.empty()) {
+            std::ostringstream contents;
+            contents << std::cin.rdbuf();
+            input = contents.str();
+            source = input;
+        }
+        else {
+            file = std::make_unique<MappedFile>(path);
+            source = file->data();
+        }
+        Parser<std::complex<double>> parser(notation);
+        auto expr = parser.parse(source);
+        if (!save_path.empty() && save_expressions(save_path, { expr }) != 0)
+            return 1;
+        std::cout << "bytes: " << parser.bytes() << '\n';
+        std::cout << "nodes: " << parser.nodes() << '\n';
+        std::cout << "seconds: " << parser.seconds() << '\n';
+        std::cout << "MB/s: " << parser.throughput() << '\n';
+    }
+    catch (const std::runtime_error& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+// Reads name=value arguments starting at argv[first], remembering their order.
+bool parse_bindings(int argc, char** argv, int first, std::unordered_map<std::string, std::complex<double>>& env, std::vector<std::string>& names) {
+    std::string vname = "";
+    std::string vvalue = "";
+    for (int i = first; i < argc; i++) {
+        vname.clear();
+        vvalue.clear();
+        bool was_eq = false;
+        for (char c : std::string(argv[i])) {
+            if (c == '=') {
+                if (was_eq)
+                    return false;
+                was_eq = true;
+                continue;
+            }
+            if (was_eq)
+                vvalue.push_back(c);
+            else
+                vname.push_back(c);
+        }
+        env[vname] = parse_number_complex(vvalue);
+        names.push_back(vname);
+    }
+    return true;
+}
+
+// Removes a flag (and, for options, its value) from argv.
+bool take_flag(int& argc, char** argv, const std::string& flag, std::string* value = nullptr) {
+    int width = value ? 2 : 1;
+    for (int i = 1; i + width <= argc; i++) {
+        if (std::string(argv[i]) != flag)
+            continue;
+        if (value)
+            *value = argv[i + 1];
+        for (int j = i; j + width < argc; j++)
+            argv[j] = argv[j + width];
+        argc -= width;
+        return true;
+    }
+    return false;
+}
+
+int run(int argc, char** argv) {
     std::unordered_map<std::string, std::complex<double>> env;
-    if (argc < 3)
+    bool simplify = take_flag(argc, argv, "--simplify");
+    Notation notation = take_flag(argc, argv, "--infix") ? Notation::INFIX : Notation::POSTFIX;
+    Domain domain = Domain::DOUBLE;
+    bool single = take_flag(argc, argv, "--float");
+    bool complex = take_flag(argc, argv, "--complex");
+    if (single && complex)
         return fail(std::string(argv[0]));
-    if (std::string(argv[1]) == "--diff") {
-        input = argv[2];
-        if (argc != 5)
+    if (single)
+        domain = Domain::FLOAT;
+    if (complex)
+        domain = Domain::COMPLEX;
+    std::string threads_option;
+    size_t threads = 1;
+    if (take_flag(argc, argv, "--threads", &threads_option)) {
+        // Digits only: stoul skips spaces and wraps "-1" around to SIZE_MAX.
+        constexpr size_t max_threads = 256;
+        if (threads_option.empty() || threads_option.find_first_not_of("0123456789") != std::string::npos)
             return fail(std::string(argv[0]));
-        if (std::string(argv[3]) != "--by")
+        try {
+            threads = std::stoul(threads_option);
+        }
+        catch (const std::exception&) {
             return fail(std::string(argv[0]));
-        by = std::string(argv[4]);
-        std::shared_ptr<Expression<std::complex<double>>> expr = parse(input);
-        std::cout << expr->differentiate(by)->to_string();
-    }
-    else if (std::string(argv[1]) == "--eval") {
-        input = argv[2];
-        std::string vname = "";
-        std::string vvalue = "";
-        for (int i = 3; i < argc; i++) {
-            vname.clear();
-            vvalue.clear();
-            bool was_eq = false;
-            for (char c : std::string(argv[i])) {
-                if (c == '=') {
-                    if (was_eq)
-                        return fail(std::string(argv[0]));
-                    was_eq = true;
-                    continue;
-                }
-                if (was_eq)
-                    vvalue.push_back(c);
-                else
-                    vname.push_back(c);
+        }
+        if (threads > max_threads)
+            return fail(std::string(argv[0]));
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    std::string load_path;
+    std::string save_path;
+    bool load = take_flag(argc, argv, "--load", &load_path);
+    bool save = take_flag(argc, argv, "--save", &save_path);
+    // Only --eval and --grad evaluate in float.
+    if (single && (argc < 2 || (std::string(argv[1]) != "--eval" && std::string(argv[1]) != "--grad")))
+        return fail(std::string(argv[0]));
+    if (argc >= 2 && std::string(argv[1]) == "--batch") {
+        if (argc > 3)
+            return fail(std::string(argv[0]));
+        Statistics::Phase phase("batch");
+        return run_batch(argc == 3 ? std::string(argv[2]) : std::string(), simplify, notation, threads, domain != Domain::COMPLEX);
+    }
+    if (argc >= 2 && std::string(argv[1]) == "--parse") {
+        if (argc > 3)
+            return fail(std::string(argv[0]));
+        Statistics::Phase phase("parse");
+        return run_parse(argc == 3 ? std::string(argv[2]) : std::string(), notation, save_path);
+    }
+    std::string mode = argc >= 2 ? argv[1] : "";
+    if (mode != "--diff" && mode != "--hessian" && mode != "--eval" && mode != "--grad") {
+        // No mode: print the expressions, or convert them with --save.
+        // An unknown option is not an expression.
+        if (argc != (load ? 1 : 2) || (!load && std::string(argv[1]).rfind("--", 0) == 0))
+            return fail(std::string(argv[0]));
+        std::vector<std::shared_ptr<Expression<std::complex<double>>>> exprs = read_expressions(load ? load_path : std::string(), load ? "" : argv[1], notation);
+        if (simplify) {
+            {
+                Statistics::Phase phase("simplify");
+                for (auto& expr : exprs)
+                    expr = expr->simplify();
             }
-            env[vname] = parse_number_complex(vvalue);
+            record_shape("simplified", exprs);
         }
-        std::shared_ptr<Expression<std::complex<double>>> expr = parse(input);
-        std::cout << expr->eval(env);
+        if (save)
+            return save_expressions(save_path, exprs);
+        Statistics::Phase phase("print");
+        for (const auto& expr : exprs)
+            std::cout << *expr << '\n';
+        return 0;
     }
-    else
+    // With --load the expressions come from the file and the [expression]
+    // argument is left out.
+    int first = load ? 2 : 3;
+    if (argc < first)
         return fail(std::string(argv[0]));
+    std::vector<std::shared_ptr<Expression<std::complex<double>>>> exprs = read_expressions(load ? load_path : std::string(), load ? "" : argv[2], notation);
+    std::vector<std::string> variables;
+    if (mode == "--diff" || mode == "--hessian") {
+        if (argc != first + 2 || std::string(argv[first]) != "--by")
+            return fail(std::string(argv[0]));
+        // Empty names ("x,", ",,") are dropped; an empty list is an error.
+        std::stringstream list(argv[first + 1]);
+        for (std::string variable; std::getline(list, variable, ',');)
+            if (!variable.empty())
+                variables.push_back(variable);
+        if (variables.empty())
+            return fail(std::string(argv[0]));
+    }
+    if (mode == "--diff") {
+        std::vector<std::shared_ptr<Expression<std::complex<double>>>> diffs;
+        if (exprs.size() == 1 && variables.size() == 1) {
+            {
+                Statistics::Phase phase("differentiate");
+                diffs.push_back(exprs[0]->differentiate(variables[0]));
+            }
+            record_shape("derivative", diffs);
+            if (simplify) {
+                Statistics::Phase phase("simplify");
+                diffs[0] = diffs[0]->simplify();
+            }
+        }
+        else {
+            // Several derivatives: computed in parallel, one per line.
+            ThreadPool pool(threads);
+            {
+                Statistics::Phase phase("differentiate");
+                for (auto& row : parallel_jacobian(pool, exprs, variables))
+                    diffs.insert(diffs.end(), row.begin(), row.end());
+            }
+            record_shape("derivative", diffs);
+            if (simplify) {
+                Statistics::Phase phase("simplify");
+                parallel_for(pool, 0, diffs.size(), 1, [&](size_t begin, size_t end) {
+                    for (size_t i = begin; i < end; i++)
+                        diffs[i] = diffs[i]->simplify();
+                });
+            }
+        }
+        if (simplify)
+            record_shape("simplified", diffs);
+        if (save)
+            return save_expressions(save_path, diffs);
+        Statistics::Phase phase("print");
+        if (diffs.size() == 1) {
+            diffs[0]->print(std::cout);
+            return 0;
+        }
+        for (size_t i = 0; i < diffs.size(); i++)
+            std::cout << "d/d" << variables[i % variables.size()] << ": " << *diffs[i] << '\n';
+    }
+    else if (mode == "--hessian") {
+        // One factory for all entries: derivatives and simplifications of
+        // shared subtrees, including the symmetric entries, are done once.
+        ExpressionFactory<std::complex<double>> factory;
+        std::vector<std::shared_ptr<Expression<std::complex<double>>>> entries;
+        {
+            Statistics::Phase phase("differentiate");
+            for (const auto& expr : exprs)
+                for (const auto& row : factory.hessian(expr, variables))
+                    entries.insert(entries.end(), row.begin(), row.end());
+        }
+        record_shape("derivative", entries);
+        if (simplify) {
+            {
+                Statistics::Phase phase("simplify");
+                for (auto& entry : entries)
+                    entry = factory.simplify(entry);
+            }
+            record_shape("simplified", entries);
+        }
+        if (save)
+            return save_expressions(save_path, entries);
+        Statistics::Phase phase("print");
+        size_t n = variables.size();
+        for (size_t k = 0; k < entries.size(); k++) {
+            size_t i = k / n % n, j = k % n;
+            if (i <= j)
+                std::cout << "d2/d" << variables[i] << "d" << variables[j] << ": " << *entries[k] << '\n';
+        }
+    }
+    else if (mode == "--eval") {
+        std::vector<std::string> names;
+        if (!parse_bindings(argc, argv, first, env, names))
+            return fail(std::string(argv[0]));
+        Statistics::Phase phase("eval");
+        if (exprs.size() == 1)
+            std::cout << printable(eval_value(exprs[0], env, domain));
+        else
+            for (const auto& expr : exprs)
+                std::cout << printable(eval_value(expr, env, domain)) << '\n';
+    }
+    else {
+        std::vector<std::string> names;
+        if (!parse_bindings(argc, argv, first, env, names))
+            return fail(std::string(argv[0]));
+        Statistics::Phase phase("gradient");
+        for (const auto& expr : exprs) {
+            std::unordered_map<std::string, std::complex<double>> partials;
+            std::cout << "value: " << printable(gradient_value(expr, env, partials, domain)) << '\n';
+            for (const std::string& name : names)
+                std::cout << "d/d" << name << ": " << printable(partials[name]) << '\n';
+        }
+    }
     return 0;
-    
+}
+
+int main(int argc, char** argv) {
+    stats = take_flag(argc, argv, "--stats");
+    int status = run(argc, argv);
+    if (stats)
+        print_stats(std::cerr);
+    return status;
 }
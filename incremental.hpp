@@ -0,0 +1,302 @@
+#ifndef INCREMENTAL_HPP
+#define INCREMENTAL_HPP
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "symbolic.hpp"
+
+// Evaluates one expression repeatedly while its variables change a few at a
+// time. The tree is flattened once into a postorder DAG (shared subtrees and
+// repeated variables become one node) that caches the value of every node.
+// For each variable it keeps the nodes that depend on it, in evaluation
+// order; after set(), eval() recomputes only those nodes. A node whose
+// operands all kept their values is skipped, so a change that stops
+// propagating (x * 0, an unchanged binding) goes no further.
+//
+// Values are bitwise identical to Expression::eval on the same bindings,
+// constant exponents included.
+template <typename T>
+class IncrementalEvaluator {
+public:
+    using Opcode = typename CompiledExpression<T>::Opcode;
+
+    explicit IncrementalEvaluator(const Expression<T>& expr) {
+        flatten(expr);
+    }
+
+    void set(std::uint32_t symbol, T value) {
+        auto it = slot_index.find(symbol);
+        if (it == slot_index.end())
+            return; // the expression does not use this variable
+        std::uint32_t slot = it->second;
+        std::uint32_t node = variable_nodes[slot];
+        if (bound[slot] && same_value(values[node], value))
+            return;
+        values[node] = value;
+        if (!bound[slot]) {
+            bound[slot] = true;
+            unbound--;
+        }
+        if (std::find(pending.begin(), pending.end(), slot) == pending.end())
+            pending.push_back(slot);
+    }
+    void set(const std::string& name, T value) {
+        if (auto symbol = SymbolTable::find(name))
+            set(*symbol, value);
+    }
+    void set(const Environment<T>& environment) {
+        for (const auto& slot : slot_index)
+            if (environment.contains(slot.first))
+                set(slot.first, environment.get(slot.first));
+    }
+
+    // Value of the expression for the current bindings. Throws if a variable
+    // of the expression has never been set.
+    T eval() {
+        if (unbound != 0)
+            for (size_t slot = 0; slot < variables.size(); slot++)
+                if (!bound[slot])
+                    throw std::runtime_error("Unknown variable: " + variables[slot]);
+        last_recomputed = 0;
+        if (!evaluated) {
+            for (std::uint32_t i = 0; i < nodes.size(); i++)
+                if (nodes[i].operation)
+                    compute(i);
+            last_recomputed = operations;
+            evaluated = true;
+            pending.clear();
+            return values[root];
+        }
+        if (pending.empty())
+            return values[root];
+        epoch++;
+        for (std::uint32_t slot : pending)
+            changed[variable_nodes[slot]] = epoch;
+        const std::vector<std::uint32_t>* order = &dependents(pending[0]);
+        if (pending.size() > 1) {
+            // Union of the dependents of every changed variable, in evaluation order.
+            merged.clear();
+            for (std::uint32_t slot : pending)
+                merged.insert(merged.end(), dependents(slot).begin(), dependents(slot).end());
+            std::sort(merged.begin(), merged.end());
+            merged.erase(std::unique(merged.begin(), merged.end()), merged.end());
+            order = &merged;
+        }
+        pending.clear();
+        for (std::uint32_t i : *order) {
+            const Node& node = nodes[i];
+            if (changed[node.left] != epoch && changed[node.right] != epoch)
+                continue;
+            T previous = values[i];
+            compute(i);
+            last_recomputed++;
+            if (!same_value(previous, values[i]))
+                changed[i] = epoch;
+        }
+        return values[root];
+    }
+
+    // Variables of the expression, in order of first appearance.
+    const std::vector<std::string>& variable_names() const {
+        return variables;
+    }
+    // Distinct nodes of the flattened expression.
+    size_t size() const {
+        return nodes.size();
+    }
+    // Operation nodes evaluated by the last eval().
+    size_t recomputed() const {
+        return last_recomputed;
+    }
+private:
+    struct Node {
+        bool operation; // false for constants and variables
+        bool constant;
+        Opcode op;
+        std::uint32_t left, right; // operand nodes; right == left for unary ops
+    };
+    std::vector<Node> nodes;
+    std::vector<T> values;
+    std::vector<std::uint32_t> changed; // epoch of the last eval() that changed the value
+    std::uint32_t epoch = 0;
+    std::uint32_t root = 0;
+    size_t operations = 0;
+    // Users of each node, as offsets into parent_list.
+    std::vector<std::uint32_t> parent_offsets;
+    std::vector<std::uint32_t> parent_list;
+
+    std::vector<std::string> variables;
+    std::vector<std::uint32_t> variable_nodes;
+    std::unordered_map<std::uint32_t, std::uint32_t> slot_index; // symbol -> slot
+    std::vector<bool> bound;
+    size_t unbound = 0;
+    // Nodes that depend on each variable, built on first change.
+    std::vector<std::vector<std::uint32_t>> cones;
+    std::vector<bool> cone_built;
+    std::vector<std::uint32_t> pending;
+    std::vector<std::uint32_t> merged;
+    bool evaluated = false;
+    size_t last_recomputed = 0;
+
+    void flatten(const Expression<T>& expr) {
+        using U = UnaryOperationExpression<T>;
+        using B = BinaryOperationExpression<T>;
+        std::unordered_map<const Expression<T>*, std::uint32_t> index;
+        std::vector<std::pair<const Expression<T>*, bool>> stack{ { &expr, false } };
+        auto add = [&](Node node, T value) {
+            nodes.push_back(node);
+            values.push_back(value);
+            return static_cast<std::uint32_t>(nodes.size() - 1);
+        };
+        while (!stack.empty()) {
+            auto [e, expanded] = stack.back();
+            if (index.count(e)) {
+                stack.pop_back();
+                continue;
+            }
+            auto unary = dynamic_cast<const U*>(e);
+            auto binary = dynamic_cast<const B*>(e);
+            if (!expanded && (unary || binary)) {
+                stack.back().second = true;
+                if (unary)
+                    stack.push_back({ unary->operand.get(), false });
+                else {
+                    stack.push_back({ binary->operand_right.get(), false });
+                    stack.push_back({ binary->operand_left.get(), false });
+                }
+                continue;
+            }
+            stack.pop_back();
+            std::uint32_t i;
+            if (auto c = dynamic_cast<const ConstExpression<T>*>(e))
+                i = add({ false, true, Opcode(), 0, 0 }, c->value);
+            else if (auto v = dynamic_cast<const VariableExpression<T>*>(e)) {
+                auto slot = slot_index.find(v->symbol);
+                if (slot != slot_index.end())
+                    i = variable_nodes[slot->second];
+                else {
+                    i = add({ false, false, Opcode(), 0, 0 }, T());
+                    slot_index.emplace(v->symbol, static_cast<std::uint32_t>(variables.size()));
+                    variables.push_back(v->name);
+                    variable_nodes.push_back(i);
+                }
+            }
+            else if (unary) {
+                std::uint32_t operand = index.at(unary->operand.get());
+                i = add({ true, false, unary_opcode(unary->type), operand, operand }, T());
+            }
+            else if (binary) {
+                std::uint32_t left = index.at(binary->operand_left.get());
+                std::uint32_t right = index.at(binary->operand_right.get());
+                i = add({ true, false, binary_opcode(binary->type), left, right }, T());
+            }
+            else
+                throw std::runtime_error("Unknown expression type");
+            index.emplace(e, i);
+        }
+        root = index.at(&expr);
+        changed.assign(nodes.size(), 0);
+        bound.assign(variables.size(), false);
+        unbound = variables.size();
+        cones.resize(variables.size());
+        cone_built.assign(variables.size(), false);
+        // Parent lists in compressed form: count, prefix-sum, fill.
+        parent_offsets.assign(nodes.size() + 1, 0);
+        for (const Node& node : nodes)
+            if (node.operation) {
+                operations++;
+                parent_offsets[node.left + 1]++;
+                if (node.right != node.left)
+                    parent_offsets[node.right + 1]++;
+            }
+        for (size_t i = 0; i < nodes.size(); i++)
+            parent_offsets[i + 1] += parent_offsets[i];
+        parent_list.resize(parent_offsets.back());
+        std::vector<std::uint32_t> fill(parent_offsets.begin(), parent_offsets.end() - 1);
+        for (std::uint32_t i = 0; i < nodes.size(); i++)
+            if (nodes[i].operation) {
+                parent_list[fill[nodes[i].left]++] = i;
+                if (nodes[i].right != nodes[i].left)
+                    parent_list[fill[nodes[i].right]++] = i;
+            }
+    }
+    // Operation nodes reachable upward from the variable, in postorder.
+    const std::vector<std::uint32_t>& dependents(std::uint32_t slot) {
+        std::vector<std::uint32_t>& cone = cones[slot];
+        if (cone_built[slot])
+            return cone;
+        std::vector<bool> seen(nodes.size(), false);
+        std::vector<std::uint32_t> stack{ variable_nodes[slot] };
+        while (!stack.empty()) {
+            std::uint32_t node = stack.back();
+            stack.pop_back();
+            for (std::uint32_t k = parent_offsets[node]; k < parent_offsets[node + 1]; k++) {
+                std::uint32_t parent = parent_list[k];
+                if (!seen[parent]) {
+                    seen[parent] = true;
+                    cone.push_back(parent);
+                    stack.push_back(parent);
+                }
+            }
+        }
+        // Node indices are a postorder, so ascending order evaluates operands first.
+        std::sort(cone.begin(), cone.end());
+        cone_built[slot] = true;
+        return cone;
+    }
+    void compute(std::uint32_t i) {
+        using Compiled = CompiledExpression<T>;
+        const Node& node = nodes[i];
+        const T& l = values[node.left];
+        const T& r = values[node.right];
+        T& v = values[i];
+        switch (node.op) {
+        case Compiled::INV: v = -l; break;
+        case Compiled::EXP: v = Elementary<T>::exp(l); break;
+        case Compiled::SIN: v = Elementary<T>::sin(l); break;
+        case Compiled::COS: v = Elementary<T>::cos(l); break;
+        case Compiled::LOG: v = Elementary<T>::log(l); break;
+        case Compiled::ADD: v = l + r; break;
+        case Compiled::SUB: v = l - r; break;
+        case Compiled::MUL: v = l * r; break;
+        case Compiled::DIV: v = l / r; break;
+        case Compiled::POW: v = nodes[node.right].constant ? Elementary<T>::power(l, r) : Elementary<T>::pow(l, r); break;
+        }
+    }
+    static Opcode unary_opcode(typename UnaryOperationExpression<T>::Type type) {
+        using U = UnaryOperationExpression<T>;
+        using Compiled = CompiledExpression<T>;
+        switch (type) {
+        case U::INV: return Compiled::INV;
+        case U::EXP: return Compiled::EXP;
+        case U::SIN: return Compiled::SIN;
+        case U::COS: return Compiled::COS;
+        case U::LOG: return Compiled::LOG;
+        default: throw std::runtime_error("Unknown unary operation");
+        }
+    }
+    static Opcode binary_opcode(typename BinaryOperationExpression<T>::Type type) {
+        using B = BinaryOperationExpression<T>;
+        using Compiled = CompiledExpression<T>;
+        switch (type) {
+        case B::ADD: return Compiled::ADD;
+        case B::SUB: return Compiled::SUB;
+        case B::MUL: return Compiled::MUL;
+        case B::DIV: return Compiled::DIV;
+        case B::POW: return Compiled::POW;
+        default: throw std::runtime_error("Unknown binary operation");
+        }
+    }
+    // Bitwise, so a NaN rebinding to the same NaN is not a change.
+    static bool same_value(const T& a, const T& b) {
+        return std::memcmp(&a, &b, sizeof(T)) == 0;
+    }
+};
+
+#endif
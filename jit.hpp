@@ -0,0 +1,339 @@
+#ifndef JIT_HPP
+#define JIT_HPP
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <dlfcn.h>
+#include <unistd.h>
+#include "symbolic.hpp"
+
+// Spelling of a value type and its constants in generated C++.
+template <typename T>
+struct JitType;
+
+template <>
+struct JitType<double> {
+    static std::string name() {
+        return "double";
+    }
+    // Hexadecimal literals round-trip exactly.
+    static std::string literal(double value) {
+        if (std::isnan(value))
+            return "__builtin_nan(\"\")";
+        if (std::isinf(value))
+            return value > 0 ? "__builtin_inf()" : "(-__builtin_inf())";
+        char buffer[64];
+        std::snprintf(buffer, sizeof(buffer), "%a", value);
+        return std::string("(") + buffer + ")";
+    }
+    // Elementary<T> as generated source, over the typedef T.
+    static std::string prelude() {
+        return real_prelude();
+    }
+    static std::string real_prelude() {
+        return "static const int max_integer_exponent = " + std::to_string(Elementary<double>::max_integer_exponent) + ";\n"
+            "static inline T f_exp(T x) { return std::exp(x); }\n"
+            "static inline T f_sin(T x) { return std::sin(x); }\n"
+            "static inline T f_cos(T x) { return std::cos(x); }\n"
+            "static inline T f_log(T x) { return std::log(x); }\n"
+            "static inline T f_pow(T l, T r) { return f_exp(r * f_log(l)); }\n"
+            "static inline T integer_power(T base, int n) {\n"
+            "    unsigned k = n < 0 ? -static_cast<unsigned>(n) : static_cast<unsigned>(n);\n"
+            "    T result = T(1);\n"
+            "    for (; k != 0; k >>= 1) {\n"
+            "        if (k & 1)\n            result *= base;\n"
+            "        if (k > 1)\n            base *= base;\n"
+            "    }\n"
+            "    return n < 0 ? T(1) / result : result;\n"
+            "}\n"
+            "static inline T f_power(T l, T c) {\n"
+            "    if (c >= -max_integer_exponent && c <= max_integer_exponent && c == std::round(c))\n"
+            "        return integer_power(l, static_cast<int>(c));\n"
+            "    return std::pow(l, c);\n"
+            "}\n";
+    }
+};
+
+template <>
+struct JitType<float> {
+    static std::string name() {
+        return "float";
+    }
+    static std::string literal(float value) {
+        return "float(" + JitType<double>::literal(value) + ")";
+    }
+    static std::string prelude() {
+        return JitType<double>::real_prelude();
+    }
+};
+
+template <typename Y>
+struct JitType<std::complex<Y>> {
+    static std::string name() {
+        return "std::complex<" + JitType<Y>::name() + ">";
+    }
+    static std::string literal(const std::complex<Y>& value) {
+        return "T(" + JitType<Y>::literal(value.real()) + ", " + JitType<Y>::literal(value.imag()) + ")";
+    }
+    static std::string prelude() {
+        return "typedef T::value_type Y;\n"
+            "static const int max_integer_exponent = " + std::to_string(Elementary<std::complex<Y>>::max_integer_exponent) + ";\n"
+            "static inline T f_exp(T x) { return x.imag() == 0 ? T(std::exp(x.real())) : std::exp(x); }\n"
+            "static inline T f_sin(T x) { return x.imag() == 0 ? T(std::sin(x.real())) : std::sin(x); }\n"
+            "static inline T f_cos(T x) { return x.imag() == 0 ? T(std::cos(x.real())) : std::cos(x); }\n"
+            "static inline T f_log(T x) { return x.imag() == 0 && x.real() > 0 ? T(std::log(x.real())) : std::log(x); }\n"
+            "static inline T f_pow(T l, T r) { return f_exp(r * f_log(l)); }\n"
+            "template <typename B>\n"
+            "static inline B integer_power(B base, int n) {\n"
+            "    unsigned k = n < 0 ? -static_cast<unsigned>(n) : static_cast<unsigned>(n);\n"
+            "    B result = B(1);\n"
+            "    for (; k != 0; k >>= 1) {\n"
+            "        if (k & 1)\n            result *= base;\n"
+            "        if (k > 1)\n            base *= base;\n"
+            "    }\n"
+            "    return n < 0 ? B(1) / result : result;\n"
+            "}\n"
+            "static inline T f_power(T l, T c) {\n"
+            "    if (c.imag() == 0) {\n"
+            "        Y e = c.real();\n"
+            "        if (e >= -max_integer_exponent && e <= max_integer_exponent && e == std::round(e))\n"
+            "            return l.imag() == 0 ? T(integer_power(l.real(), static_cast<int>(e))) : integer_power(l, static_cast<int>(e));\n"
+            "        if (l.imag() == 0 && l.real() >= 0)\n"
+            "            return T(std::pow(l.real(), e));\n"
+            "    }\n"
+            "    return f_pow(l, c);\n"
+            "}\n";
+    }
+};
+
+// An expression compiled to native code. Copies share the loaded library,
+// which stays mapped until the last copy is gone.
+template <typename T>
+class JitFunction {
+public:
+    using Eval = void (*)(const T*, T*);
+    using Batch = void (*)(const T* const*, T*, size_t);
+
+    JitFunction(std::shared_ptr<void> library, Eval eval_function, Batch batch_function, std::vector<std::string> variables, std::vector<std::uint32_t> symbols)
+        : library(std::move(library)), eval_function(eval_function), batch_function(batch_function), variables(std::move(variables)), symbols(std::move(symbols)) {}
+
+    // slots[i] holds the value of variables[i].
+    T operator()(const T* slots) const {
+        T result;
+        eval_function(slots, &result);
+        return result;
+    }
+    T operator()(const std::unordered_map<std::string, T>& environment) const {
+        std::vector<T> slots;
+        slots.reserve(variables.size());
+        for (const std::string& name : variables) {
+            auto it = environment.find(name);
+            if (it == environment.end())
+                throw std::runtime_error("Unknown variable: " + name);
+            slots.push_back(it->second);
+        }
+        return (*this)(slots.data());
+    }
+    T operator()(const Environment<T>& environment) const {
+        std::vector<T> slots;
+        slots.reserve(symbols.size());
+        for (std::uint32_t symbol : symbols)
+            slots.push_back(environment.get(symbol));
+        return (*this)(slots.data());
+    }
+    // Same layout as CompiledExpression::eval_batch.
+    void eval_batch(const T* const* columns, T* out, size_t count) const {
+        batch_function(columns, out, count);
+    }
+
+    std::shared_ptr<void> library;
+    Eval eval_function;
+    Batch batch_function;
+    std::vector<std::string> variables;
+    std::vector<std::uint32_t> symbols;
+};
+
+// Generates a straight-line C++ function per expression, builds it as a
+// shared object with the system compiler and loads it with dlopen.
+// Artifacts are cached on disk under the FNV-1a hash of the compiler command
+// line and the generated source, which is a canonical spelling of the
+// expression, so another process asking for the same expression with the
+// same compiler and flags loads the cached object directly.
+//
+// The code is built without -ffast-math or contraction and spells out the
+// same Elementary<T> functions, so results are bitwise identical to eval()
+// on the same machine.
+template <typename T>
+class JitCompiler {
+public:
+    explicit JitCompiler(std::string cache_directory = default_cache_directory(), std::string compiler = default_compiler())
+        : cache_directory(std::move(cache_directory)), compiler(std::move(compiler)) {
+        std::filesystem::create_directories(this->cache_directory);
+    }
+
+    JitFunction<T> compile(const Expression<T>& expr) {
+        return compile(expr.compile());
+    }
+    JitFunction<T> compile(const CompiledExpression<T>& tape) {
+        // The command line heads the stored source, so a different compiler
+        // or set of flags never reuses an object built by another.
+        std::string source = "// " + compiler + " " + flags + "\n" + generate(tape);
+        std::string key = hash(source);
+        std::string base = (std::filesystem::path(cache_directory) / ("expr_" + key)).string();
+        std::string library_path = base + ".so";
+        if (!cached(base + ".cpp", source) || !std::filesystem::exists(library_path))
+            build(base, source);
+        else
+            hit_count++;
+        void* handle = dlopen(library_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (!handle)
+            throw std::runtime_error(std::string("Cannot load compiled expression: ") + dlerror());
+        std::shared_ptr<void> library(handle, [](void* h) { dlclose(h); });
+        auto eval_function = reinterpret_cast<typename JitFunction<T>::Eval>(dlsym(handle, "symbolic_jit_eval"));
+        auto batch_function = reinterpret_cast<typename JitFunction<T>::Batch>(dlsym(handle, "symbolic_jit_batch"));
+        if (!eval_function || !batch_function)
+            throw std::runtime_error("Compiled expression is missing its entry points");
+        return JitFunction<T>(library, eval_function, batch_function, tape.variables, tape.symbols);
+    }
+
+    // C++ source of the function for a tape. Every instruction becomes one
+    // const local, constants are inlined as exact literals.
+    static std::string generate(const CompiledExpression<T>& tape) {
+        using Compiled = CompiledExpression<T>;
+        size_t leaves = tape.constants.size() + tape.variables.size();
+        auto value = [&](std::uint32_t source) {
+            if (source < tape.constants.size())
+                return JitType<T>::literal(tape.constants[source]);
+            if (source < leaves)
+                return "v[" + std::to_string(source - tape.constants.size()) + "]";
+            return "t" + std::to_string(source - leaves);
+        };
+        std::ostringstream out;
+        out << "#include <cmath>\n#include <complex>\n#include <cstddef>\n";
+        out << "typedef " << JitType<T>::name() << " T;\n";
+        out << JitType<T>::prelude();
+        out << "static inline T eval(const T* v) {\n";
+        for (size_t i = 0; i < tape.code.size(); i++) {
+            std::string l = value(tape.sources[i].left);
+            std::string r = value(tape.sources[i].right);
+            out << "    const T t" << i << " = ";
+            switch (tape.code[i].op) {
+            case Compiled::INV: out << "-" << l; break;
+            case Compiled::EXP: out << "f_exp(" << l << ")"; break;
+            case Compiled::SIN: out << "f_sin(" << l << ")"; break;
+            case Compiled::COS: out << "f_cos(" << l << ")"; break;
+            case Compiled::LOG: out << "f_log(" << l << ")"; break;
+            case Compiled::ADD: out << l << " + " << r; break;
+            case Compiled::SUB: out << l << " - " << r; break;
+            case Compiled::MUL: out << l << " * " << r; break;
+            case Compiled::DIV: out << l << " / " << r; break;
+            case Compiled::POW: out << (tape.sources[i].right < tape.constants.size() ? "f_power(" : "f_pow(") << l << ", " << r << ")"; break;
+            }
+            out << ";\n";
+        }
+        out << "    return " << value(tape.result_source) << ";\n}\n";
+        out << "extern \"C\" void symbolic_jit_eval(const T* v, T* out) {\n    *out = eval(v);\n}\n";
+        out << "extern \"C\" void symbolic_jit_batch(const T* const* columns, T* out, std::size_t count) {\n";
+        out << "    for (std::size_t i = 0; i < count; i++) {\n";
+        out << "        T v[" << std::max<size_t>(tape.variables.size(), 1) << "];\n";
+        for (size_t k = 0; k < tape.variables.size(); k++)
+            out << "        v[" << k << "] = columns[" << k << "][i];\n";
+        out << "        out[i] = eval(v);\n    }\n}\n";
+        return out.str();
+    }
+
+    // Number of expressions built by this compiler and loaded from the cache.
+    size_t builds() const {
+        return build_count;
+    }
+    size_t hits() const {
+        return hit_count;
+    }
+
+    // $SYMBOLIC_JIT_CACHE, else $XDG_CACHE_HOME/symbolic-jit, else
+    // ~/.cache/symbolic-jit, else a directory under the system temp path.
+    static std::string default_cache_directory() {
+        if (const char* dir = std::getenv("SYMBOLIC_JIT_CACHE"))
+            return dir;
+        if (const char* dir = std::getenv("XDG_CACHE_HOME"))
+            return (std::filesystem::path(dir) / "symbolic-jit").string();
+        if (const char* dir = std::getenv("HOME"))
+            return (std::filesystem::path(dir) / ".cache" / "symbolic-jit").string();
+        return (std::filesystem::temp_directory_path() / "symbolic-jit").string();
+    }
+    // $CXX, else c++.
+    static std::string default_compiler() {
+        const char* cxx = std::getenv("CXX");
+        return cxx ? cxx : "c++";
+    }
+private:
+    static constexpr const char* flags = "-std=c++17 -O2 -ffp-contract=off -fno-fast-math -fPIC -shared";
+    std::string cache_directory;
+    std::string compiler;
+    size_t build_count = 0;
+    size_t hit_count = 0;
+
+    static std::string hash(const std::string& text) {
+        std::uint64_t h = 14695981039346656037ull;
+        for (unsigned char c : text) {
+            h ^= c;
+            h *= 1099511628211ull;
+        }
+        char buffer[17];
+        std::snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(h));
+        return buffer;
+    }
+    // The stored source guards against hash collisions.
+    static bool cached(const std::string& path, const std::string& source) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+            return false;
+        std::ostringstream contents;
+        contents << in.rdbuf();
+        return contents.str() == source;
+    }
+    static std::string quote(const std::string& text) {
+        std::string quoted = "'";
+        for (char c : text)
+            quoted += c == '\'' ? std::string("'\\''") : std::string(1, c);
+        return quoted + "'";
+    }
+    // Builds into unique temporaries and renames them into place, so
+    // concurrent builders never observe a partially written file.
+    void build(const std::string& base, const std::string& source) {
+        static std::atomic<unsigned> sequence{ 0 };
+        std::string suffix = ".tmp" + std::to_string(getpid()) + "_" + std::to_string(sequence++);
+        std::string source_path = base + suffix + ".cpp";
+        std::string library_path = base + suffix + ".so";
+        std::string log_path = base + suffix + ".log";
+        {
+            std::ofstream out(source_path, std::ios::binary);
+            out << source;
+            if (!out)
+                throw std::runtime_error("Cannot write " + source_path);
+        }
+        std::string command = compiler + " " + flags + " -o " + quote(library_path) + " " + quote(source_path) + " > " + quote(log_path) + " 2>&1";
+        int status = std::system(command.c_str());
+        if (status != 0) {
+            std::ifstream log(log_path);
+            std::ostringstream message;
+            message << "Expression compilation failed (" << command << ")\n" << log.rdbuf();
+            std::filesystem::remove(source_path);
+            std::filesystem::remove(log_path);
+            throw std::runtime_error(message.str());
+        }
+        std::filesystem::remove(log_path);
+        std::filesystem::rename(library_path, base + ".so");
+        std::filesystem::rename(source_path, base + ".cpp");
+        build_count++;
+    }
+};
+
+#endif
@@ -0,0 +1,232 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "symbolic.hpp"
+
+// Fixed-size work-stealing thread pool. Every worker owns a deque: it pushes
+// and pops its own tasks at the back, idle workers steal from the front of
+// the others. Threads that wait for a TaskGroup run queued tasks themselves,
+// so parallel calls may be nested inside tasks without deadlocking.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads = std::thread::hardware_concurrency())
+        : queues(threads == 0 ? 1 : threads) {
+        for (size_t i = 0; i < queues.size(); i++)
+            workers.emplace_back([this, i] { work(i); });
+    }
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(idle_mutex);
+            stopping = true;
+        }
+        idle.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const {
+        return workers.size();
+    }
+    // Index of the calling worker in [0, size()), or size() for other threads.
+    size_t current_index() const {
+        return current_pool == this ? current_worker : size();
+    }
+    void submit(std::function<void()> task) {
+        size_t index = current_index();
+        if (index == size())
+            index = next_queue.fetch_add(1, std::memory_order_relaxed) % queues.size();
+        // Counted before it is visible, so a thief can never drive pending below zero.
+        pending.fetch_add(1, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> lock(queues[index].mutex);
+            queues[index].tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(idle_mutex);
+        }
+        idle.notify_one();
+    }
+    // Runs one queued task on the calling thread, if there is any.
+    bool run_one() {
+        std::function<void()> task;
+        if (!take(current_index(), task))
+            return false;
+        task();
+        return true;
+    }
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+    std::vector<Queue> queues;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> next_queue{ 0 };
+    std::atomic<size_t> pending{ 0 };
+    std::mutex idle_mutex;
+    std::condition_variable idle;
+    bool stopping = false;
+    static inline thread_local const ThreadPool* current_pool = nullptr;
+    static inline thread_local size_t current_worker = 0;
+
+    // Own queue first (newest task, still warm in cache), then steal the oldest.
+    bool take(size_t index, std::function<void()>& task) {
+        if (pending.load(std::memory_order_acquire) == 0)
+            return false;
+        if (index < queues.size()) {
+            std::lock_guard<std::mutex> lock(queues[index].mutex);
+            if (!queues[index].tasks.empty()) {
+                task = std::move(queues[index].tasks.back());
+                queues[index].tasks.pop_back();
+                pending.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        for (size_t offset = 1; offset <= queues.size(); offset++) {
+            Queue& victim = queues[(index + offset) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                pending.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+    void work(size_t index) {
+        current_pool = this;
+        current_worker = index;
+        std::function<void()> task;
+        while (true) {
+            if (take(index, task)) {
+                task();
+                task = nullptr;
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(idle_mutex);
+            idle.wait(lock, [this] { return stopping || pending.load(std::memory_order_acquire) > 0; });
+            if (stopping && pending.load(std::memory_order_acquire) == 0)
+                return;
+        }
+    }
+};
+
+// A set of tasks that can be waited on. The first exception thrown by a task
+// is rethrown from wait().
+class TaskGroup {
+public:
+    explicit TaskGroup(ThreadPool& pool)
+        : pool(pool) {}
+    ~TaskGroup() {
+        if (remaining.load() != 0)
+            drain();
+    }
+    template <typename F>
+    void run(F task) {
+        remaining.fetch_add(1, std::memory_order_relaxed);
+        pool.submit([this, task]() mutable {
+            try {
+                task();
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+            // Decremented under the lock: once wait() has seen zero and taken
+            // the lock, no task touches the group again.
+            std::lock_guard<std::mutex> lock(mutex);
+            if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                done.notify_all();
+        });
+    }
+    void wait() {
+        drain();
+        if (error)
+            std::rethrow_exception(error);
+    }
+private:
+    ThreadPool& pool;
+    std::atomic<size_t> remaining{ 0 };
+    std::mutex mutex;
+    std::condition_variable done;
+    std::exception_ptr error;
+
+    void drain() {
+        while (remaining.load(std::memory_order_acquire) != 0) {
+            if (pool.run_one())
+                continue;
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait_for(lock, std::chrono::microseconds(100), [this] { return remaining.load(std::memory_order_acquire) == 0; });
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+    }
+};
+
+// Calls body(chunk_begin, chunk_end) over [begin, end) split into chunks of
+// at most grain elements, in parallel.
+template <typename F>
+void parallel_for(ThreadPool& pool, size_t begin, size_t end, size_t grain, F body) {
+    if (grain == 0)
+        grain = 1;
+    if (end - begin <= grain) {
+        if (begin < end)
+            body(begin, end);
+        return;
+    }
+    TaskGroup group(pool);
+    for (size_t chunk = begin; chunk < end; chunk += grain) {
+        size_t chunk_end = std::min(end, chunk + grain);
+        group.run([&body, chunk, chunk_end] { body(chunk, chunk_end); });
+    }
+    group.wait();
+}
+
+// CompiledExpression::eval_batch split over chunks of points. The tape is
+// only read, so one compiled expression is shared by every worker.
+template <typename T>
+void parallel_eval_batch(ThreadPool& pool, const CompiledExpression<T>& compiled, const T* const* columns, T* out, size_t count, size_t grain = 1 << 14) {
+    parallel_for(pool, 0, count, grain, [&](size_t begin, size_t end) {
+        std::vector<const T*> chunk(compiled.variables.size());
+        for (size_t v = 0; v < chunk.size(); v++)
+            chunk[v] = columns[v] + begin;
+        compiled.eval_batch(chunk.data(), out + begin, end - begin);
+    });
+}
+
+// One derivative per variable, computed concurrently. Expression trees are
+// immutable, so the workers share expr without copying it.
+template <typename T>
+std::vector<std::shared_ptr<Expression<T>>> parallel_differentiate(ThreadPool& pool, const Expression<T>& expr, const std::vector<std::string>& variables) {
+    std::vector<std::shared_ptr<Expression<T>>> result(variables.size());
+    parallel_for(pool, 0, variables.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            result[i] = expr.differentiate(variables[i]);
+    });
+    return result;
+}
+
+// Jacobian matrix: result[i][j] is d expressions[i] / d variables[j].
+template <typename T>
+std::vector<std::vector<std::shared_ptr<Expression<T>>>> parallel_jacobian(ThreadPool& pool, const std::vector<std::shared_ptr<Expression<T>>>& expressions, const std::vector<std::string>& variables) {
+    std::vector<std::vector<std::shared_ptr<Expression<T>>>> result(expressions.size(), std::vector<std::shared_ptr<Expression<T>>>(variables.size()));
+    size_t columns = variables.size();
+    parallel_for(pool, 0, expressions.size() * columns, 1, [&](size_t begin, size_t end) {
+        for (size_t k = begin; k < end; k++)
+            result[k / columns][k % columns] = expressions[k / columns]->differentiate(variables[k % columns]);
+    });
+    return result;
+}
+
+#endif
@@ -0,0 +1,382 @@
+#ifndef PARSER_HPP
+#define PARSER_HPP
+#include <charconv>
+#include <chrono>
+#include <complex>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+#include "symbolic.hpp"
+
+// A real literal; the whole text must be a number.
+inline double parse_number_real(std::string_view source) {
+    if (source.empty())
+        throw std::runtime_error("Number cannot be empty");
+    std::string_view digits = source;
+    if (digits.front() == '+')
+        digits.remove_prefix(1);
+    double value = 0;
+    auto [end, error] = std::from_chars(digits.data(), digits.data() + digits.size(), value);
+    if (error != std::errc() || end != digits.data() + digits.size())
+        throw std::runtime_error("Wrong number format: " + std::string(source));
+    return value;
+}
+// "a", "bi" or "a+bi" / "a-bi". Signs inside an exponent do not split the
+// real and imaginary parts.
+inline std::complex<double> parse_number_complex(std::string_view source) {
+    if (source.empty())
+        throw std::runtime_error("Number cannot be empty");
+    bool imaginary = source.back() == 'i';
+    std::string_view number = imaginary ? source.substr(0, source.size() - 1) : source;
+    size_t split = std::string_view::npos;
+    for (size_t i = 1; i < number.size(); i++) {
+        if ((number[i] == '+' || number[i] == '-') && number[i - 1] != 'e' && number[i - 1] != 'E') {
+            split = i;
+            break;
+        }
+    }
+    if (split == std::string_view::npos)
+        return imaginary ? std::complex<double>(0, parse_number_real(number)) : std::complex<double>(parse_number_real(number), 0);
+    if (!imaginary)
+        throw std::runtime_error("Cannot create complex number without an operation");
+    return std::complex<double>(parse_number_real(number.substr(0, split)), parse_number_real(number.substr(split)));
+}
+
+template <typename T>
+struct is_complex_number : std::false_type {};
+template <typename Y>
+struct is_complex_number<std::complex<Y>> : std::true_type {};
+
+enum class Notation { POSTFIX, INFIX };
+
+// Single-pass tokenizer over a string_view; tokens point into the source.
+class Lexer {
+public:
+    enum Kind { NUMBER, NAME, PLUS, MINUS, STAR, SLASH, CARET, LPAREN, RPAREN, END };
+    struct Token {
+        Kind kind;
+        std::string_view text;
+        size_t offset;
+    };
+    Lexer(std::string_view source, Notation notation)
+        : source(source), notation(notation) {}
+
+    Token next() {
+        while (position < source.size() && is_space(source[position]))
+            position++;
+        if (position == source.size())
+            return { END, {}, position };
+        return notation == Notation::POSTFIX ? next_postfix() : next_infix();
+    }
+private:
+    std::string_view source;
+    Notation notation;
+    size_t position = 0;
+
+    static bool is_space(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+    }
+    static bool is_digit(char c) {
+        return c >= '0' && c <= '9';
+    }
+    static bool is_name(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || is_digit(c);
+    }
+    static Kind operator_kind(char c) {
+        switch (c) {
+        case '+': return PLUS;
+        case '-': return MINUS;
+        case '*': return STAR;
+        case '/': return SLASH;
+        case '^': return CARET;
+        case '(': return LPAREN;
+        case ')': return RPAREN;
+        default: return END;
+        }
+    }
+    Token take(Kind kind, size_t begin) {
+        return { kind, source.substr(begin, position - begin), begin };
+    }
+    // Postfix tokens are whitespace-separated words: a word starting with a
+    // digit or '.' is a number (complex literals like 1+2i included), a
+    // single operator character is an operator, anything else a name.
+    Token next_postfix() {
+        size_t begin = position;
+        while (position < source.size() && !is_space(source[position]))
+            position++;
+        char first = source[begin];
+        if (is_digit(first) || first == '.')
+            return take(NUMBER, begin);
+        Kind kind = position - begin == 1 ? operator_kind(first) : END;
+        return take(kind == END ? NAME : kind, begin);
+    }
+    // Infix numbers are digits with an optional fraction and exponent, and an
+    // optional trailing i for imaginary literals.
+    Token next_infix() {
+        size_t begin = position;
+        char first = source[position];
+        if (is_digit(first) || first == '.') {
+            while (position < source.size() && (is_digit(source[position]) || source[position] == '.'))
+                position++;
+            if (position < source.size() && (source[position] == 'e' || source[position] == 'E')) {
+                size_t exponent = position + 1;
+                if (exponent < source.size() && (source[exponent] == '+' || source[exponent] == '-'))
+                    exponent++;
+                if (exponent < source.size() && is_digit(source[exponent])) {
+                    position = exponent;
+                    while (position < source.size() && is_digit(source[position]))
+                        position++;
+                }
+            }
+            if (position < source.size() && source[position] == 'i')
+                position++;
+            return take(NUMBER, begin);
+        }
+        if (is_name(first)) {
+            while (position < source.size() && is_name(source[position]))
+                position++;
+            return take(NAME, begin);
+        }
+        Kind kind = operator_kind(first);
+        if (kind == END)
+            throw std::runtime_error("Unexpected character '" + std::string(1, first) + "' at offset " + std::to_string(begin));
+        position++;
+        return take(kind, begin);
+    }
+};
+
+// Builds expressions from postfix (RPN) or infix text in one pass over the
+// input. Nodes are created in place on an arena by a non-consing factory;
+// operands are moved, never cloned. Infix input goes through a
+// shunting-yard pass that feeds the same builder: ^ is right-associative
+// and binds tighter than unary minus (-x^2 is -(x^2)), and functions apply
+// to the operand right after them, so sin x^2 is (sin x)^2.
+template <typename T>
+class Parser {
+public:
+    using B = BinaryOperationExpression<T>;
+    using U = UnaryOperationExpression<T>;
+
+    explicit Parser(Notation notation = Notation::POSTFIX)
+        : notation(notation) {}
+
+    std::shared_ptr<Expression<T>> parse(std::string_view source) {
+        auto start = std::chrono::steady_clock::now();
+        ExpressionArena arena;
+        ExpressionFactory<T> factory(false, arena);
+        this->factory = &factory;
+        stack.clear();
+        node_count = 0;
+        Lexer lexer(source, notation);
+        if (notation == Notation::POSTFIX)
+            parse_postfix(lexer);
+        else
+            parse_infix(lexer);
+        this->factory = nullptr;
+        if (stack.size() != 1)
+            throw std::runtime_error("Malformed expression");
+        std::shared_ptr<Expression<T>> result = std::move(stack.back());
+        stack.clear();
+        byte_count = source.size();
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return result;
+    }
+
+    // Statistics of the last successful parse.
+    size_t bytes() const {
+        return byte_count;
+    }
+    size_t nodes() const {
+        return node_count;
+    }
+    double seconds() const {
+        return elapsed;
+    }
+    double throughput() const { // MB/s
+        return elapsed > 0 ? byte_count / elapsed / 1e6 : 0;
+    }
+
+    // Function names, dispatched on length and first letter.
+    static bool function(std::string_view name, typename U::Type& type) {
+        switch (name.size()) {
+        case 2:
+            if (name == "ln") { type = U::LOG; return true; }
+            return false;
+        case 3:
+            switch (name[0]) {
+            case 's': type = U::SIN; return name == "sin";
+            case 'c': type = U::COS; return name == "cos";
+            case 'e': type = U::EXP; return name == "exp";
+            default: return false;
+            }
+        default:
+            return false;
+        }
+    }
+private:
+    // Pending infix operators; functions and unary minus are prefix.
+    enum Operator : std::uint8_t { OPEN, ADD, SUB, MUL, DIV, POW, NEG, FUNCTION };
+    struct Pending {
+        Operator op;
+        typename U::Type function;
+    };
+    Notation notation;
+    ExpressionFactory<T>* factory = nullptr;
+    std::vector<std::shared_ptr<Expression<T>>> stack;
+    std::vector<Pending> pending;
+    size_t byte_count = 0;
+    size_t node_count = 0;
+    double elapsed = 0;
+
+    static T number(std::string_view text) {
+        if constexpr (is_complex_number<T>::value)
+            return T(parse_number_complex(text));
+        else {
+            if (!text.empty() && text.back() == 'i')
+                throw std::runtime_error("Imaginary number in a real expression: " + std::string(text));
+            return T(parse_number_real(text));
+        }
+    }
+    void push(std::shared_ptr<Expression<T>> node) {
+        stack.push_back(std::move(node));
+        node_count++;
+    }
+    void variable(std::string_view name) {
+        push(factory->variable(std::string(name)));
+    }
+    void binary(typename B::Type type) {
+        if (stack.size() < 2)
+            throw std::runtime_error("Malformed expression");
+        std::shared_ptr<Expression<T>> right = std::move(stack.back());
+        stack.pop_back();
+        stack.back() = factory->binary(type, std::move(stack.back()), std::move(right));
+        node_count++;
+    }
+    void unary(typename U::Type type) {
+        if (stack.empty())
+            throw std::runtime_error("Malformed expression");
+        stack.back() = factory->unary(type, std::move(stack.back()));
+        node_count++;
+    }
+
+    void parse_postfix(Lexer& lexer) {
+        typename U::Type type;
+        for (Lexer::Token token = lexer.next(); token.kind != Lexer::END; token = lexer.next()) {
+            switch (token.kind) {
+            case Lexer::NUMBER: push(factory->constant(number(token.text))); break;
+            case Lexer::PLUS: binary(B::ADD); break;
+            case Lexer::MINUS: binary(B::SUB); break;
+            case Lexer::STAR: binary(B::MUL); break;
+            case Lexer::SLASH: binary(B::DIV); break;
+            case Lexer::CARET: binary(B::POW); break;
+            default:
+                if (function(token.text, type))
+                    unary(type);
+                else
+                    variable(token.text);
+                break;
+            }
+        }
+    }
+
+    static int precedence(Operator op) {
+        switch (op) {
+        case ADD: case SUB: return 1;
+        case MUL: case DIV: return 2;
+        case NEG: return 3;
+        case POW: return 4;
+        case FUNCTION: return 5;
+        default: return 0;
+        }
+    }
+    void apply(const Pending& entry) {
+        switch (entry.op) {
+        case ADD: binary(B::ADD); break;
+        case SUB: binary(B::SUB); break;
+        case MUL: binary(B::MUL); break;
+        case DIV: binary(B::DIV); break;
+        case POW: binary(B::POW); break;
+        case NEG: unary(U::INV); break;
+        case FUNCTION: unary(entry.function); break;
+        default: throw std::runtime_error("Unbalanced parentheses");
+        }
+    }
+    // Applies pending operators that bind at least as tightly as an incoming
+    // binary operator (strictly tighter for the right-associative ^).
+    void reduce(Operator incoming) {
+        int p = precedence(incoming);
+        while (!pending.empty() && pending.back().op != OPEN) {
+            int top = precedence(pending.back().op);
+            if (top < p || (top == p && incoming == POW))
+                break;
+            apply(pending.back());
+            pending.pop_back();
+        }
+    }
+    static std::runtime_error unexpected(const Lexer::Token& token) {
+        if (token.kind == Lexer::END)
+            return std::runtime_error("Unexpected end of expression");
+        return std::runtime_error("Unexpected '" + std::string(token.text) + "' at offset " + std::to_string(token.offset));
+    }
+    void parse_infix(Lexer& lexer) {
+        pending.clear();
+        bool expect_operand = true;
+        typename U::Type type;
+        Lexer::Token token = lexer.next();
+        if (token.kind == Lexer::END)
+            throw std::runtime_error("Malformed expression");
+        for (;; token = lexer.next()) {
+            if (expect_operand) {
+                switch (token.kind) {
+                case Lexer::NUMBER:
+                    push(factory->constant(number(token.text)));
+                    expect_operand = false;
+                    break;
+                case Lexer::NAME:
+                    if (function(token.text, type))
+                        pending.push_back({ FUNCTION, type });
+                    else {
+                        variable(token.text);
+                        expect_operand = false;
+                    }
+                    break;
+                case Lexer::MINUS: pending.push_back({ NEG, U::INV }); break;
+                case Lexer::PLUS: break;
+                case Lexer::LPAREN: pending.push_back({ OPEN, U::INV }); break;
+                default: throw unexpected(token);
+                }
+                continue;
+            }
+            Operator op;
+            switch (token.kind) {
+            case Lexer::PLUS: op = ADD; break;
+            case Lexer::MINUS: op = SUB; break;
+            case Lexer::STAR: op = MUL; break;
+            case Lexer::SLASH: op = DIV; break;
+            case Lexer::CARET: op = POW; break;
+            case Lexer::RPAREN:
+                reduce(ADD);
+                if (pending.empty())
+                    throw std::runtime_error("Unbalanced parentheses at offset " + std::to_string(token.offset));
+                pending.pop_back();
+                continue;
+            case Lexer::END:
+                while (!pending.empty()) {
+                    apply(pending.back());
+                    pending.pop_back();
+                }
+                return;
+            default: throw unexpected(token);
+            }
+            reduce(op);
+            pending.push_back({ op, U::INV });
+            expect_operand = true;
+        }
+    }
+};
+
+#endif
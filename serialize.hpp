@@ -0,0 +1,248 @@
+#ifndef SERIALIZE_HPP
+#define SERIALIZE_HPP
+#include <cstdint>
+#include <cstring>
+#include <complex>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "symbolic.hpp"
+
+// Value type tag stored in the file header.
+template <typename T>
+struct SerialType;
+template <>
+struct SerialType<double> {
+    static constexpr std::uint32_t tag = 1;
+};
+template <>
+struct SerialType<float> {
+    static constexpr std::uint32_t tag = 2;
+};
+template <>
+struct SerialType<std::complex<double>> {
+    static constexpr std::uint32_t tag = 3;
+};
+template <>
+struct SerialType<std::complex<float>> {
+    static constexpr std::uint32_t tag = 4;
+};
+
+// Binary format for a forest of expressions, in native byte order:
+//
+//   header     "SYMX", version, value type, symbol count, constant count,
+//              node count, root count, reserved (eight 32-bit words)
+//   symbols    per symbol: 32-bit length and the name bytes; padded to 8
+//   constants  raw T values
+//   nodes      12-byte records {kind, op, reserved16, a, b} in postorder
+//   roots      32-bit node indices
+//
+// Constants hold an index into the constant table, variables an index into
+// the symbol table, unary and binary nodes the indices of their children.
+// Children always come before their parents, and a subtree shared in
+// memory is written once and referenced by index, so derivative trees
+// keep their sharing on disk. Loading is a single linear pass over the
+// records with no text parsing; the input may be a memory-mapped file.
+namespace serial {
+    constexpr char magic[4] = { 'S', 'Y', 'M', 'X' };
+    constexpr std::uint32_t version = 1;
+    enum Kind : std::uint8_t { CONSTANT, VARIABLE, UNARY, BINARY };
+    struct Header {
+        char magic[4];
+        std::uint32_t version, type, symbols, constants, nodes, roots, reserved;
+    };
+    struct Node {
+        std::uint8_t kind, op;
+        std::uint16_t reserved;
+        std::uint32_t a, b;
+    };
+    static_assert(sizeof(Header) == 32 && sizeof(Node) == 12, "Unexpected record layout");
+}
+
+template <typename T>
+std::string serialize(const std::vector<std::shared_ptr<Expression<T>>>& roots) {
+    using U = UnaryOperationExpression<T>;
+    using B = BinaryOperationExpression<T>;
+    std::vector<serial::Node> nodes;
+    std::vector<T> constants;
+    std::vector<std::string> symbols;
+    std::unordered_map<const Expression<T>*, std::uint32_t> written;
+    std::unordered_map<std::uint32_t, std::uint32_t> symbol_index; // SymbolTable id -> file symbol
+    std::vector<std::uint32_t> root_index;
+    // Postorder with an explicit stack; a node is emitted once its children are.
+    std::vector<std::pair<const Expression<T>*, bool>> stack;
+    auto index = [&](const std::shared_ptr<Expression<T>>& child) { return written.at(child.get()); };
+    for (const auto& root : roots) {
+        stack.push_back({ root.get(), false });
+        while (!stack.empty()) {
+            auto [expr, expanded] = stack.back();
+            if (written.count(expr)) {
+                stack.pop_back();
+                continue;
+            }
+            auto unary = dynamic_cast<const U*>(expr);
+            auto binary = dynamic_cast<const B*>(expr);
+            if (!expanded && (unary || binary)) {
+                stack.back().second = true;
+                if (unary)
+                    stack.push_back({ unary->operand.get(), false });
+                else {
+                    stack.push_back({ binary->operand_right.get(), false });
+                    stack.push_back({ binary->operand_left.get(), false });
+                }
+                continue;
+            }
+            stack.pop_back();
+            serial::Node node{};
+            if (auto c = dynamic_cast<const ConstExpression<T>*>(expr)) {
+                node.kind = serial::CONSTANT;
+                node.a = static_cast<std::uint32_t>(constants.size());
+                constants.push_back(c->value);
+            }
+            else if (auto v = dynamic_cast<const VariableExpression<T>*>(expr)) {
+                node.kind = serial::VARIABLE;
+                auto inserted = symbol_index.emplace(v->symbol, static_cast<std::uint32_t>(symbols.size()));
+                if (inserted.second)
+                    symbols.push_back(v->name);
+                node.a = inserted.first->second;
+            }
+            else if (unary) {
+                node.kind = serial::UNARY;
+                node.op = static_cast<std::uint8_t>(unary->type);
+                node.a = index(unary->operand);
+            }
+            else if (binary) {
+                node.kind = serial::BINARY;
+                node.op = static_cast<std::uint8_t>(binary->type);
+                node.a = index(binary->operand_left);
+                node.b = index(binary->operand_right);
+            }
+            else
+                throw std::runtime_error("Unknown expression type");
+            written.emplace(expr, static_cast<std::uint32_t>(nodes.size()));
+            nodes.push_back(node);
+        }
+        root_index.push_back(written.at(root.get()));
+    }
+
+    serial::Header header{};
+    std::memcpy(header.magic, serial::magic, sizeof(header.magic));
+    header.version = serial::version;
+    header.type = SerialType<T>::tag;
+    header.symbols = static_cast<std::uint32_t>(symbols.size());
+    header.constants = static_cast<std::uint32_t>(constants.size());
+    header.nodes = static_cast<std::uint32_t>(nodes.size());
+    header.roots = static_cast<std::uint32_t>(root_index.size());
+    std::string out;
+    auto append = [&](const void* data, size_t size) { out.append(static_cast<const char*>(data), size); };
+    append(&header, sizeof(header));
+    for (const std::string& name : symbols) {
+        std::uint32_t length = static_cast<std::uint32_t>(name.size());
+        append(&length, sizeof(length));
+        append(name.data(), name.size());
+    }
+    out.resize((out.size() + 7) / 8 * 8, '\0');
+    append(constants.data(), constants.size() * sizeof(T));
+    append(nodes.data(), nodes.size() * sizeof(serial::Node));
+    append(root_index.data(), root_index.size() * sizeof(std::uint32_t));
+    return out;
+}
+
+template <typename T>
+std::string serialize(const Expression<T>& expr) {
+    return serialize<T>(std::vector<std::shared_ptr<Expression<T>>>{ expr.share() });
+}
+
+// Rebuilds the expressions stored by serialize(), sharing subtrees the way
+// they were shared when saved. Throws on malformed or mismatched input.
+template <typename T>
+std::vector<std::shared_ptr<Expression<T>>> deserialize(std::string_view data) {
+    using U = UnaryOperationExpression<T>;
+    using B = BinaryOperationExpression<T>;
+    size_t position = 0;
+    auto read = [&](void* target, size_t size) {
+        if (size > data.size() - position)
+            throw std::runtime_error("Truncated expression data");
+        std::memcpy(target, data.data() + position, size);
+        position += size;
+    };
+    serial::Header header;
+    read(&header, sizeof(header));
+    if (std::memcmp(header.magic, serial::magic, sizeof(header.magic)) != 0 || header.version != serial::version)
+        throw std::runtime_error("Not an expression file");
+    if (header.type != SerialType<T>::tag)
+        throw std::runtime_error("Expression file holds a different value type");
+    if (header.symbols > data.size() / sizeof(std::uint32_t) || header.nodes > data.size() / sizeof(serial::Node) || header.roots > data.size() / sizeof(std::uint32_t))
+        throw std::runtime_error("Truncated expression data");
+
+    ExpressionArena arena;
+    ExpressionFactory<T> factory(false, arena);
+    std::vector<std::shared_ptr<Expression<T>>> variables;
+    variables.reserve(header.symbols);
+    for (std::uint32_t i = 0; i < header.symbols; i++) {
+        std::uint32_t length;
+        read(&length, sizeof(length));
+        if (length > data.size() - position)
+            throw std::runtime_error("Truncated expression data");
+        variables.push_back(factory.variable(std::string(data.substr(position, length))));
+        position += length;
+    }
+    position = (position + 7) / 8 * 8;
+    if (position > data.size() || header.constants > (data.size() - position) / sizeof(T))
+        throw std::runtime_error("Truncated expression data");
+    const char* constants = data.data() + position;
+    position += size_t(header.constants) * sizeof(T);
+
+    std::vector<std::shared_ptr<Expression<T>>> nodes;
+    nodes.reserve(header.nodes);
+    auto child = [&](std::uint32_t index) -> const std::shared_ptr<Expression<T>>& {
+        if (index >= nodes.size())
+            throw std::runtime_error("Corrupt expression data");
+        return nodes[index];
+    };
+    for (std::uint32_t i = 0; i < header.nodes; i++) {
+        serial::Node node;
+        read(&node, sizeof(node));
+        switch (node.kind) {
+        case serial::CONSTANT: {
+            if (node.a >= header.constants)
+                throw std::runtime_error("Corrupt expression data");
+            T value;
+            std::memcpy(&value, constants + size_t(node.a) * sizeof(T), sizeof(T));
+            nodes.push_back(factory.constant(value));
+            break;
+        }
+        case serial::VARIABLE:
+            if (node.a >= variables.size())
+                throw std::runtime_error("Corrupt expression data");
+            nodes.push_back(variables[node.a]);
+            break;
+        case serial::UNARY:
+            if (node.op > U::LOG)
+                throw std::runtime_error("Corrupt expression data");
+            nodes.push_back(factory.unary(static_cast<typename U::Type>(node.op), child(node.a)));
+            break;
+        case serial::BINARY:
+            if (node.op > B::POW)
+                throw std::runtime_error("Corrupt expression data");
+            nodes.push_back(factory.binary(static_cast<typename B::Type>(node.op), child(node.a), child(node.b)));
+            break;
+        default:
+            throw std::runtime_error("Corrupt expression data");
+        }
+    }
+    std::vector<std::shared_ptr<Expression<T>>> roots;
+    roots.reserve(header.roots);
+    for (std::uint32_t i = 0; i < header.roots; i++) {
+        std::uint32_t index;
+        read(&index, sizeof(index));
+        roots.push_back(child(index));
+    }
+    return roots;
+}
+
+#endif
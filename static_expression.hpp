@@ -0,0 +1,397 @@
+#ifndef STATIC_EXPRESSION_HPP
+#define STATIC_EXPRESSION_HPP
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "symbolic.hpp"
+
+// Expression templates for formulas known at compile time. The shape of
+// an expression is its type; nodes hold only constant values, so eval()
+// inlines into straight-line code with no allocation or virtual calls, and
+// is constexpr wherever the operations on T are. Variables are positional:
+// var<I> reads slot I, the same slot layout CompiledExpression uses.
+//
+//     using namespace static_expression;
+//     constexpr auto x = var<0>;
+//     constexpr auto y = var<1>;
+//     constexpr auto f = x * x + 3.0 * y;
+//     static_assert(f(2.0, 1.0) == 7.0);
+//     constexpr auto df = diff(f, x);        // 2x, derived by the compiler
+//     auto g = to_dynamic<double>(f, { "x", "y" });
+//
+// The operators, derivative rules and evaluation mirror the dynamic tree,
+// POW included (Elementary::power for a constant exponent, exp(r*log(l))
+// otherwise). Derivatives fold the exact zeros and ones they create at the
+// type level, so d/dx of a term without x is the empty type Zero and
+// disappears from sums and products. The derivatives are therefore those of
+// Expression::differentiate followed by simplify(), not of differentiate
+// alone. The difference shows for l^c with a constant c: the l^c * 0 * log(l)
+// term is dropped and the exponent c - 1 is folded, so d/dx x^3 is 3 * x^2,
+// finite for negative x, where the unsimplified dynamic derivative is NaN.
+namespace static_expression {
+
+    struct NodeTag {};
+
+    // Base of every node: call syntax over the slots.
+    template <typename Derived>
+    struct Node : NodeTag {
+        template <typename... Args>
+        constexpr auto operator()(Args... args) const {
+            using T = std::common_type_t<Args...>;
+            const T slots[] = { T(args)... };
+            return static_cast<const Derived&>(*this).eval(slots);
+        }
+    };
+
+    template <typename E>
+    constexpr bool is_node = std::is_base_of_v<NodeTag, E>;
+
+    struct Zero : Node<Zero> {
+        template <typename T>
+        constexpr T eval(const T*) const {
+            return T(0);
+        }
+    };
+    struct One : Node<One> {
+        template <typename T>
+        constexpr T eval(const T*) const {
+            return T(1);
+        }
+    };
+    template <typename C>
+    struct Constant : Node<Constant<C>> {
+        C value;
+        constexpr explicit Constant(C value)
+            : value(value) {}
+        template <typename T>
+        constexpr T eval(const T*) const {
+            return T(value);
+        }
+    };
+    template <size_t I>
+    struct Variable : Node<Variable<I>> {
+        static constexpr size_t index = I;
+        template <typename T>
+        constexpr T eval(const T* slots) const {
+            return slots[I];
+        }
+    };
+    template <size_t I>
+    constexpr Variable<I> var{};
+
+    // Operation tags: how to apply them and which dynamic node they become.
+    struct Neg {
+        template <typename T>
+        static constexpr T apply(const T& a) { return -a; }
+        template <typename T>
+        static constexpr auto type = UnaryOperationExpression<T>::INV;
+    };
+    struct Exp {
+        template <typename T>
+        static constexpr T apply(const T& a) { return Elementary<T>::exp(a); }
+        template <typename T>
+        static constexpr auto type = UnaryOperationExpression<T>::EXP;
+    };
+    struct Sin {
+        template <typename T>
+        static constexpr T apply(const T& a) { return Elementary<T>::sin(a); }
+        template <typename T>
+        static constexpr auto type = UnaryOperationExpression<T>::SIN;
+    };
+    struct Cos {
+        template <typename T>
+        static constexpr T apply(const T& a) { return Elementary<T>::cos(a); }
+        template <typename T>
+        static constexpr auto type = UnaryOperationExpression<T>::COS;
+    };
+    struct Log {
+        template <typename T>
+        static constexpr T apply(const T& a) { return Elementary<T>::log(a); }
+        template <typename T>
+        static constexpr auto type = UnaryOperationExpression<T>::LOG;
+    };
+    struct Add {
+        template <typename T>
+        static constexpr T apply(const T& a, const T& b) { return a + b; }
+        template <typename T>
+        static constexpr auto type = BinaryOperationExpression<T>::ADD;
+    };
+    struct Sub {
+        template <typename T>
+        static constexpr T apply(const T& a, const T& b) { return a - b; }
+        template <typename T>
+        static constexpr auto type = BinaryOperationExpression<T>::SUB;
+    };
+    struct Mul {
+        template <typename T>
+        static constexpr T apply(const T& a, const T& b) { return a * b; }
+        template <typename T>
+        static constexpr auto type = BinaryOperationExpression<T>::MUL;
+    };
+    struct Div {
+        template <typename T>
+        static constexpr T apply(const T& a, const T& b) { return a / b; }
+        template <typename T>
+        static constexpr auto type = BinaryOperationExpression<T>::DIV;
+    };
+    struct Pow {
+        template <typename T>
+        static constexpr T apply(const T& a, const T& b) { return Elementary<T>::pow(a, b); }
+        template <typename T>
+        static constexpr auto type = BinaryOperationExpression<T>::POW;
+    };
+
+    template <typename Op, typename A>
+    struct Unary : Node<Unary<Op, A>> {
+        A operand;
+        constexpr explicit Unary(A operand)
+            : operand(operand) {}
+        template <typename T>
+        constexpr T eval(const T* slots) const {
+            return Op::apply(operand.eval(slots));
+        }
+    };
+    // Leaves with a fixed value; a power with one as its exponent uses
+    // Elementary::power, as a dynamic POW over a ConstExpression does.
+    template <typename E>
+    struct is_constant : std::false_type {};
+    template <>
+    struct is_constant<Zero> : std::true_type {};
+    template <>
+    struct is_constant<One> : std::true_type {};
+    template <typename C>
+    struct is_constant<Constant<C>> : std::true_type {};
+    template <typename E>
+    struct is_literal : std::false_type {};
+    template <typename C>
+    struct is_literal<Constant<C>> : std::true_type {};
+
+    template <typename Op, typename L, typename R>
+    struct Binary : Node<Binary<Op, L, R>> {
+        L left;
+        R right;
+        constexpr Binary(L left, R right)
+            : left(left), right(right) {}
+        template <typename T>
+        constexpr T eval(const T* slots) const {
+            if constexpr (std::is_same_v<Op, Pow> && is_constant<R>::value)
+                return Elementary<T>::power(left.eval(slots), right.eval(slots));
+            else
+                return Op::apply(left.eval(slots), right.eval(slots));
+        }
+    };
+
+    template <typename E>
+    constexpr bool is_zero = std::is_same_v<E, Zero>;
+    template <typename E>
+    constexpr bool is_one = std::is_same_v<E, One>;
+
+    // Arithmetic operands of the operators become constants.
+    template <typename E>
+    constexpr auto lift(const E& e) {
+        if constexpr (is_node<E>)
+            return e;
+        else
+            return Constant<E>(e);
+    }
+    template <typename L, typename R>
+    using enable_operands = std::enable_if_t<(is_node<L> || is_node<R>) && (is_node<L> || std::is_arithmetic_v<L>) && (is_node<R> || std::is_arithmetic_v<R>)>;
+
+    template <typename L, typename R, typename = enable_operands<L, R>>
+    constexpr auto operator+(const L& l, const R& r) {
+        return Binary<Add, decltype(lift(l)), decltype(lift(r))>(lift(l), lift(r));
+    }
+    template <typename L, typename R, typename = enable_operands<L, R>>
+    constexpr auto operator-(const L& l, const R& r) {
+        return Binary<Sub, decltype(lift(l)), decltype(lift(r))>(lift(l), lift(r));
+    }
+    template <typename L, typename R, typename = enable_operands<L, R>>
+    constexpr auto operator*(const L& l, const R& r) {
+        return Binary<Mul, decltype(lift(l)), decltype(lift(r))>(lift(l), lift(r));
+    }
+    template <typename L, typename R, typename = enable_operands<L, R>>
+    constexpr auto operator/(const L& l, const R& r) {
+        return Binary<Div, decltype(lift(l)), decltype(lift(r))>(lift(l), lift(r));
+    }
+    template <typename L, typename R, typename = enable_operands<L, R>>
+    constexpr auto operator^(const L& l, const R& r) {
+        return Binary<Pow, decltype(lift(l)), decltype(lift(r))>(lift(l), lift(r));
+    }
+    template <typename A, typename = std::enable_if_t<is_node<A>>>
+    constexpr auto operator-(const A& a) {
+        return Unary<Neg, A>(a);
+    }
+    template <typename A, typename = std::enable_if_t<is_node<A>>>
+    constexpr auto exp(const A& a) {
+        return Unary<Exp, A>(a);
+    }
+    template <typename A, typename = std::enable_if_t<is_node<A>>>
+    constexpr auto sin(const A& a) {
+        return Unary<Sin, A>(a);
+    }
+    template <typename A, typename = std::enable_if_t<is_node<A>>>
+    constexpr auto cos(const A& a) {
+        return Unary<Cos, A>(a);
+    }
+    template <typename A, typename = std::enable_if_t<is_node<A>>>
+    constexpr auto ln(const A& a) {
+        return Unary<Log, A>(a);
+    }
+
+    // Builders used by diff(): identities with the exact Zero and One are
+    // applied to the types, everything else builds the plain node.
+    template <typename A, typename B>
+    constexpr auto add(const A& a, const B& b) {
+        if constexpr (is_zero<A>)
+            return b;
+        else if constexpr (is_zero<B>)
+            return a;
+        else
+            return Binary<Add, A, B>(a, b);
+    }
+    template <typename A>
+    constexpr auto neg(const A& a) {
+        if constexpr (is_zero<A>)
+            return Zero{};
+        else
+            return Unary<Neg, A>(a);
+    }
+    template <typename A, typename B>
+    constexpr auto sub(const A& a, const B& b) {
+        if constexpr (is_zero<B>)
+            return a;
+        else if constexpr (is_zero<A>)
+            return neg(b);
+        else
+            return Binary<Sub, A, B>(a, b);
+    }
+    template <typename A, typename B>
+    constexpr auto mul(const A& a, const B& b) {
+        if constexpr (is_zero<A> || is_zero<B>)
+            return Zero{};
+        else if constexpr (is_one<A>)
+            return b;
+        else if constexpr (is_one<B>)
+            return a;
+        else
+            return Binary<Mul, A, B>(a, b);
+    }
+    template <typename A, typename B>
+    constexpr auto div(const A& a, const B& b) {
+        if constexpr (is_zero<A>)
+            return Zero{};
+        else if constexpr (is_one<B>)
+            return a;
+        else
+            return Binary<Div, A, B>(a, b);
+    }
+
+    template <typename E>
+    struct is_variable : std::false_type {};
+    template <size_t I>
+    struct is_variable<Variable<I>> : std::true_type {};
+    template <typename E>
+    struct is_unary : std::false_type {};
+    template <typename Op, typename A>
+    struct is_unary<Unary<Op, A>> : std::true_type {
+        using op = Op;
+    };
+    template <typename E>
+    struct is_binary : std::false_type {};
+    template <typename Op, typename L, typename R>
+    struct is_binary<Binary<Op, L, R>> : std::true_type {
+        using op = Op;
+    };
+
+    // d e / d var<I>, computed entirely from the type of e.
+    template <size_t I, typename E>
+    constexpr auto diff(const E& e) {
+        if constexpr (std::is_same_v<E, Variable<I>>)
+            return One{};
+        else if constexpr (is_unary<E>::value) {
+            using Op = typename is_unary<E>::op;
+            using A = decltype(e.operand);
+            const A& a = e.operand;
+            auto da = diff<I>(a);
+            if constexpr (std::is_same_v<Op, Neg>)
+                return neg(da);
+            else if constexpr (std::is_same_v<Op, Exp>)
+                return mul(e, da);
+            else if constexpr (std::is_same_v<Op, Sin>)
+                return mul(Unary<Cos, A>(a), da);
+            else if constexpr (std::is_same_v<Op, Cos>)
+                return mul(neg(Unary<Sin, A>(a)), da);
+            else
+                return mul(div(One{}, a), da);
+        }
+        else if constexpr (is_binary<E>::value) {
+            using Op = typename is_binary<E>::op;
+            using L = decltype(e.left);
+            using R = decltype(e.right);
+            const L& l = e.left;
+            const R& r = e.right;
+            auto dl = diff<I>(l);
+            auto dr = diff<I>(r);
+            if constexpr (std::is_same_v<Op, Add>)
+                return add(dl, dr);
+            else if constexpr (std::is_same_v<Op, Sub>)
+                return sub(dl, dr);
+            else if constexpr (std::is_same_v<Op, Mul>)
+                return add(mul(dl, r), mul(l, dr));
+            else if constexpr (std::is_same_v<Op, Div>)
+                return div(sub(mul(dl, r), mul(l, dr)), mul(r, r));
+            else {
+                // r * l^(r - 1) * dl + l^r * dr * log(l); for a constant r,
+                // dr is Zero and r - 1 is folded, so l^(r - 1) keeps
+                // Elementary::power.
+                auto lower = [&] {
+                    if constexpr (is_literal<R>::value)
+                        return Binary<Pow, L, R>(l, R(r.value - 1));
+                    else {
+                        using Exponent = Binary<Sub, R, One>;
+                        return Binary<Pow, L, Exponent>(l, Exponent(r, One{}));
+                    }
+                }();
+                return add(mul(mul(r, lower), dl), mul(mul(e, dr), Unary<Log, L>(l)));
+            }
+        }
+        else
+            return Zero{};
+    }
+    template <typename E, size_t I>
+    constexpr auto diff(const E& e, Variable<I>) {
+        return diff<I>(e);
+    }
+
+    // Builds the equivalent dynamic tree; names[i] is the name of var<i>.
+    template <typename T, typename E>
+    std::shared_ptr<Expression<T>> to_dynamic(const E& e, const std::vector<std::string>& names, ExpressionFactory<T>& factory) {
+        if constexpr (is_zero<E>)
+            return factory.constant(T(0));
+        else if constexpr (is_one<E>)
+            return factory.constant(T(1));
+        else if constexpr (is_unary<E>::value)
+            return factory.unary(is_unary<E>::op::template type<T>, to_dynamic<T>(e.operand, names, factory));
+        else if constexpr (is_binary<E>::value)
+            return factory.binary(is_binary<E>::op::template type<T>, to_dynamic<T>(e.left, names, factory), to_dynamic<T>(e.right, names, factory));
+        else if constexpr (is_variable<E>::value) {
+            if (E::index >= names.size())
+                throw std::runtime_error("No name for variable " + std::to_string(E::index));
+            return factory.variable(names[E::index]);
+        }
+        else
+            return factory.constant(T(e.value));
+    }
+    template <typename T, typename E>
+    std::shared_ptr<Expression<T>> to_dynamic(const E& e, const std::vector<std::string>& names) {
+        ExpressionFactory<T> factory(false);
+        return to_dynamic<T>(e, names, factory);
+    }
+}
+
+#endif
@@ -1,154 +1,700 @@
+#ifndef SYMBOLIC_HPP
+#define SYMBOLIC_HPP
 #include <iostream>
 #include <memory>
 #include <cmath>
 #include <string>
 #include <unordered_map>
 #include <complex>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <optional>
+#include <mutex>
+#include <shared_mutex>
+#include <deque>
+#include <atomic>
+#include <chrono>
 template <typename T> class BinaryOperationExpression;
 template <typename T> class UnaryOperationExpression;
 template <typename T> class VariableOperationExpression;
 template <typename T> class ConstantExpression;
+template <typename T> class CompiledExpression;
+template <typename T> class ExpressionFactory;
+template <typename T> struct Traversal;
 
+// Process-wide interning of variable names into dense ids, so traversals
+// compare and index integers instead of hashing strings. Ids are never
+// reused; the table is safe to use from several threads.
+class SymbolTable {
+public:
+    static std::uint32_t intern(const std::string& name) {
+        if (auto id = find(name))
+            return *id;
+        State& table = state();
+        std::unique_lock<std::shared_mutex> lock(table.mutex);
+        auto it = table.ids.find(name);
+        if (it != table.ids.end())
+            return it->second;
+        std::uint32_t id = static_cast<std::uint32_t>(table.names.size());
+        table.names.push_back(name);
+        table.ids.emplace(name, id);
+        return id;
+    }
+    // Id of a name that has been interned, without adding it.
+    static std::optional<std::uint32_t> find(const std::string& name) {
+        State& table = state();
+        std::shared_lock<std::shared_mutex> lock(table.mutex);
+        auto it = table.ids.find(name);
+        if (it == table.ids.end())
+            return std::nullopt;
+        return it->second;
+    }
+    static std::string name(std::uint32_t id) {
+        State& table = state();
+        std::shared_lock<std::shared_mutex> lock(table.mutex);
+        if (id >= table.names.size())
+            throw std::runtime_error("Unknown symbol id");
+        return table.names[id];
+    }
+    static size_t size() {
+        State& table = state();
+        std::shared_lock<std::shared_mutex> lock(table.mutex);
+        return table.names.size();
+    }
+private:
+    struct State {
+        std::shared_mutex mutex;
+        std::deque<std::string> names;
+        std::unordered_map<std::string, std::uint32_t> ids;
+    };
+    static State& state() {
+        static State table;
+        return table;
+    }
+};
+
+// Instrumentation: node construction, clone and allocation counters and
+// named phase timers. Everything is compiled in only when SYMBOLIC_STATS is
+// defined; otherwise count() and Phase are empty inline functions and the
+// queries report zeros. Each thread counts into its own block, so counting
+// never contends; queries sum over all blocks, including those of threads
+// that have exited.
+class Statistics {
+public:
+    enum Counter { CONSTANT_NODES, VARIABLE_NODES, UNARY_NODES, BINARY_NODES, CLONES, HEAP_ALLOCATIONS, ARENA_ALLOCATIONS, COUNTERS };
+#ifdef SYMBOLIC_STATS
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
+    struct PhaseTotal {
+        std::string name;
+        std::uint64_t calls;
+        double seconds;
+    };
+
+    static void count(Counter counter, std::uint64_t n = 1) {
+        if constexpr (enabled) {
+            // Only the owning thread writes its block; readers may race harmlessly.
+            std::atomic<std::uint64_t>& value = local().counters[counter];
+            value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+    }
+    static std::uint64_t get(Counter counter) {
+        std::uint64_t total = 0;
+        if constexpr (enabled) {
+            Registry& registry = state();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            for (const Block& block : registry.blocks)
+                total += block.counters[counter].load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+    static const char* name(Counter counter) {
+        static const char* names[] = { "constant_nodes", "variable_nodes", "unary_nodes", "binary_nodes", "clones", "heap_allocations", "arena_allocations" };
+        return names[counter];
+    }
+    // Totals per phase name in order of first use, summed over threads.
+    static std::vector<PhaseTotal> phases() {
+        std::vector<PhaseTotal> totals;
+        if constexpr (enabled) {
+            Registry& registry = state();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            for (Block& block : registry.blocks) {
+                std::lock_guard<std::mutex> block_lock(block.mutex);
+                for (const PhaseTotal& phase : block.phases) {
+                    auto it = std::find_if(totals.begin(), totals.end(), [&](const PhaseTotal& total) { return total.name == phase.name; });
+                    if (it == totals.end())
+                        totals.push_back(phase);
+                    else {
+                        it->calls += phase.calls;
+                        it->seconds += phase.seconds;
+                    }
+                }
+            }
+        }
+        return totals;
+    }
+    // Zeroes all counters and phases; meant for quiescent points between runs.
+    static void reset() {
+        if constexpr (enabled) {
+            Registry& registry = state();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            for (Block& block : registry.blocks) {
+                for (auto& value : block.counters)
+                    value.store(0, std::memory_order_relaxed);
+                std::lock_guard<std::mutex> block_lock(block.mutex);
+                block.phases.clear();
+            }
+        }
+    }
+
+    // Adds the wall time of its scope to the named phase. The name must
+    // outlive the scope.
+    class Phase {
+    public:
+        explicit Phase(const char* phase_name) {
+            if constexpr (enabled) {
+                name = phase_name;
+                start = std::chrono::steady_clock::now();
+            }
+        }
+        ~Phase() {
+            if constexpr (enabled) {
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                Block& block = local();
+                std::lock_guard<std::mutex> lock(block.mutex);
+                auto it = std::find_if(block.phases.begin(), block.phases.end(), [&](const PhaseTotal& total) { return total.name == name; });
+                if (it == block.phases.end())
+                    block.phases.push_back(PhaseTotal{ name, 1, seconds });
+                else {
+                    it->calls++;
+                    it->seconds += seconds;
+                }
+            }
+        }
+        Phase(const Phase&) = delete;
+        Phase& operator=(const Phase&) = delete;
+    private:
+        const char* name = nullptr;
+        std::chrono::steady_clock::time_point start;
+    };
+private:
+    struct Block {
+        std::atomic<std::uint64_t> counters[COUNTERS] = {};
+        std::mutex mutex; // guards phases
+        std::vector<PhaseTotal> phases;
+    };
+    // Blocks are never freed, so totals survive their threads.
+    struct Registry {
+        std::mutex mutex;
+        std::deque<Block> blocks;
+    };
+    static Registry& state() {
+        static Registry registry;
+        return registry;
+    }
+    static Block& local() {
+        thread_local Block* block = [] {
+            Registry& registry = state();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            return &registry.blocks.emplace_back();
+        }();
+        return *block;
+    }
+};
+
+// Empty base of each node class that counts its constructions.
+template <Statistics::Counter counter>
+struct CountedNode {
+    CountedNode() {
+        Statistics::count(counter);
+    }
+    CountedNode(const CountedNode&) {
+        Statistics::count(counter);
+    }
+    CountedNode& operator=(const CountedNode&) = default;
+};
+
+// Variable bindings stored as a flat array indexed by symbol id.
+template <typename T>
+class Environment {
+public:
+    Environment() = default;
+    // Names that were never interned cannot occur in any expression and are
+    // skipped, so they neither grow the symbol table nor the slot arrays.
+    explicit Environment(const std::unordered_map<std::string, T>& bindings) {
+        std::vector<std::pair<std::uint32_t, const T*>> found;
+        found.reserve(bindings.size());
+        std::uint32_t end = 0;
+        for (const auto& binding : bindings)
+            if (auto symbol = SymbolTable::find(binding.first)) {
+                found.emplace_back(*symbol, &binding.second);
+                end = std::max(end, *symbol + 1);
+            }
+        values.resize(end);
+        bound.resize(end, false);
+        for (const auto& binding : found)
+            set(binding.first, *binding.second);
+    }
+    void set(std::uint32_t symbol, T value) {
+        if (symbol >= values.size()) {
+            values.resize(symbol + 1);
+            bound.resize(symbol + 1, false);
+        }
+        values[symbol] = value;
+        bound[symbol] = true;
+    }
+    void set(const std::string& name, T value) {
+        set(SymbolTable::intern(name), value);
+    }
+    bool contains(std::uint32_t symbol) const {
+        return symbol < bound.size() && bound[symbol];
+    }
+    const T& get(std::uint32_t symbol) const {
+        if (!contains(symbol))
+            throw std::runtime_error("Unknown variable: " + SymbolTable::name(symbol));
+        return values[symbol];
+    }
+private:
+    std::vector<T> values;
+    std::vector<bool> bound;
+};
+
+
+// Elementary functions shared by every evaluator: trees, tapes, batches,
+// IncrementalEvaluator and the code JitCompiler generates, so all of them
+// agree bitwise. x ^ c with a constant exponent c goes through power():
+// integers up to max_integer_exponent in magnitude by repeated squaring,
+// other real exponents by std::pow. A computed exponent is exp(r * log(l)).
+template <typename T>
+struct Elementary {
+    static constexpr int max_integer_exponent = 1024;
+
+    static constexpr T exp(const T& x) {
+        return std::exp(x);
+    }
+    static constexpr T sin(const T& x) {
+        return std::sin(x);
+    }
+    static constexpr T cos(const T& x) {
+        return std::cos(x);
+    }
+    static constexpr T log(const T& x) {
+        return std::log(x);
+    }
+    static constexpr T pow(const T& l, const T& r) {
+        return exp(r * log(l));
+    }
+    static constexpr T power(const T& l, const T& c) {
+        if (c >= -max_integer_exponent && c <= max_integer_exponent && c == std::round(c))
+            return integer_power(l, static_cast<int>(c));
+        return std::pow(l, c);
+    }
+    static constexpr T integer_power(T base, int n) {
+        unsigned k = n < 0 ? -static_cast<unsigned>(n) : static_cast<unsigned>(n);
+        T result = T(1);
+        for (; k != 0; k >>= 1) {
+            if (k & 1)
+                result *= base;
+            if (k > 1)
+                base *= base;
+        }
+        return n < 0 ? T(1) / result : result;
+    }
+};
+
+// Complex arguments on the real axis go through the real function wherever
+// it is defined there; the result has a zero imaginary part. Complex
+// multiplication and division of such values are exact on the real part,
+// so a complex evaluation of real data matches the real evaluation bit for
+// bit, and costs about as much.
+template <typename Y>
+struct Elementary<std::complex<Y>> {
+    using T = std::complex<Y>;
+    static constexpr int max_integer_exponent = Elementary<Y>::max_integer_exponent;
+
+    static T exp(const T& x) {
+        return x.imag() == 0 ? T(std::exp(x.real())) : std::exp(x);
+    }
+    static T sin(const T& x) {
+        return x.imag() == 0 ? T(std::sin(x.real())) : std::sin(x);
+    }
+    static T cos(const T& x) {
+        return x.imag() == 0 ? T(std::cos(x.real())) : std::cos(x);
+    }
+    static T log(const T& x) {
+        return x.imag() == 0 && x.real() > 0 ? T(std::log(x.real())) : std::log(x);
+    }
+    static T pow(const T& l, const T& r) {
+        return exp(r * log(l));
+    }
+    static T power(const T& l, const T& c) {
+        if (c.imag() == 0) {
+            Y e = c.real();
+            if (e >= -max_integer_exponent && e <= max_integer_exponent && e == std::round(e))
+                return integer_power(l, static_cast<int>(e));
+            if (l.imag() == 0 && l.real() >= 0)
+                return T(std::pow(l.real(), e));
+        }
+        return pow(l, c);
+    }
+    // On the real axis the real loop is used: (1,0) * (inf,0) would give a
+    // NaN imaginary part once the square overflows.
+    static T integer_power(T base, int n) {
+        if (base.imag() == 0)
+            return T(Elementary<Y>::integer_power(base.real(), n));
+        unsigned k = n < 0 ? -static_cast<unsigned>(n) : static_cast<unsigned>(n);
+        T result = T(1);
+        for (; k != 0; k >>= 1) {
+            if (k & 1)
+                result *= base;
+            if (k > 1)
+                base *= base;
+        }
+        return n < 0 ? T(1) / result : result;
+    }
+};
+
+// Shape of a tree or forest. size counts a shared subtree every time it is
+// reached (saturating at SIZE_MAX), distinct counts it once; depth is the
+// number of nodes on the longest root-to-leaf path.
+struct ExpressionShape {
+    size_t size;
+    size_t distinct;
+    size_t depth;
+};
 
 template <typename T>
-class Expression {
+class Expression : public std::enable_shared_from_this<Expression<T>> {
 public:
+    enum Kind : std::uint8_t { CONSTANT, VARIABLE, UNARY, BINARY };
     virtual ~Expression() = default;
+    // Node class, so traversals can dispatch without a dynamic_cast or a
+    // virtual call per node.
+    Kind kind() const {
+        return node_kind;
+    }
     virtual T eval(const std::unordered_map<std::string, T>& environment) const = 0;
-    virtual std::string to_string() const = 0;
+    virtual T eval(const Environment<T>& environment) const = 0;
+    // Writes the fully parenthesized form; linear in the size of the tree.
+    virtual void print(std::ostream& out) const = 0;
+    std::string to_string() const {
+        std::ostringstream out;
+        print(out);
+        return out.str();
+    }
+    ExpressionShape shape() const;
     virtual std::shared_ptr<Expression<T>> clone() const = 0;
-    virtual std::shared_ptr<Expression<T>> substitute(const std::string& variable, T val) const = 0;
+    // Like clone(), but moves the children out of this node instead of sharing them.
+    virtual std::shared_ptr<Expression<T>> steal() = 0;
+    // With fold_constants, every subtree left without variables is evaluated
+    // to a single constant instead of being rebuilt around the new leaf.
+    virtual std::shared_ptr<Expression<T>> substitute(const std::string& variable, T val, bool fold_constants = false) const = 0;
+    virtual std::shared_ptr<Expression<T>> substitute(std::uint32_t variable, T val, ExpressionFactory<T>& factory) const = 0;
     virtual std::shared_ptr<Expression<T>> differentiate(const std::string& variable, bool& contains_variable) const = 0;
+    virtual std::shared_ptr<Expression<T>> differentiate(std::uint32_t variable, bool& contains_variable, ExpressionFactory<T>& factory) const = 0;
     virtual std::shared_ptr<Expression<T>> differentiate(const std::string& variable) const = 0;
-    BinaryOperationExpression<T> operator+(const Expression<T>& other) const {
+    // Identity/zero elimination, constant folding, like-term collection and
+    // power merging. Each distinct node is rewritten once.
+    virtual std::shared_ptr<Expression<T>> simplify() const = 0;
+    virtual std::shared_ptr<Expression<T>> simplify(ExpressionFactory<T>& factory) const = 0;
+    // Value and all partial derivatives in one forward and one reverse sweep.
+    T gradient(const std::unordered_map<std::string, T>& environment, std::unordered_map<std::string, T>& partials) const {
+        return compile().gradient(environment, partials);
+    }
+    // Symbolic first partials (one row of the Jacobian) and second partials.
+    // Both go through one hash-consing factory, so every (node, variable)
+    // derivative is built once; see ExpressionFactory::hessian.
+    std::vector<std::shared_ptr<Expression<T>>> jacobian(const std::vector<std::string>& variables) const {
+        ExpressionFactory<T> factory;
+        return factory.jacobian({ share() }, variables)[0];
+    }
+    std::vector<std::vector<std::shared_ptr<Expression<T>>>> hessian(const std::vector<std::string>& variables) const {
+        ExpressionFactory<T> factory;
+        return factory.hessian(share(), variables);
+    }
+    // The node itself when it is already owned by a shared_ptr, a copy otherwise.
+    // Trees are never mutated after construction, so owned nodes are shared freely.
+    std::shared_ptr<Expression<T>> share() const {
+        if (auto self = this->weak_from_this().lock())
+            return std::const_pointer_cast<Expression<T>>(self);
+        return clone();
+    }
+    // Same as share() for owned nodes; a temporary gives up its children to the new node.
+    std::shared_ptr<Expression<T>> take() {
+        if (auto self = this->weak_from_this().lock())
+            return self;
+        return steal();
+    }
+    // Appends the postorder instructions of this subtree to the tape.
+    virtual void compile_into(CompiledExpression<T>& tape) const = 0;
+    CompiledExpression<T> compile() const {
+        CompiledExpression<T> tape;
+        compile_into(tape);
+        tape.finalize();
+        return tape;
+    }
+    // Temporaries on either side are moved into the new node rather than copied,
+    // so chains like a + b + c allocate one node per operator.
+    BinaryOperationExpression<T> operator+(const Expression<T>& other) const& {
         return BinaryOperationExpression<T>(BinaryOperationExpression<T>::Type::ADD, *this, other);
     }
-    BinaryOperationExpression<T> operator-(const Expression<T>& other) const {
+    BinaryOperationExpression<T> operator+(Expression<T>&& other) const& {
+        return BinaryOperationExpression<T>(BinaryOperationExpression<T>::Type::ADD, this->share(), other.take());
+    }
+    BinaryOperationExpression<T> operator+(const Expression<T>& other) && {
+        return BinaryOperationExpression<T>(BinaryOperationExpression<T>::Type::ADD, this->take(), other.share());
+    }
+    BinaryOperationExpression<T> operator+(Expression<T>&& other) && {
+        return BinaryOperationExpression<T>(BinaryOperationExpression<T>::Type::ADD, this->take(), other.take());
+    }
+    BinaryOperationExpression<T> operator-(const Expression<T>& other) const& {
         return BinaryOperationExpression<T>(BinaryOperationExpression<T>::Type::SUB, *this, other);
     }
-    BinaryOperationExpression<T> operator*(const Expression<T>& other) const {
+    BinaryOperationExpression<T> operator-(Expression<T>&& other) const& {
+        return BinaryOperationExpression<T>(BinaryOperationExpression<T>::Type::SUB, this->share(), other.take());
+    }
+    BinaryOperationExpression<T> operator-(const Expression<T>& other) && {
+        return BinaryOperationExpression<T>(BinaryOperationExpression<T>::Type::SUB, this->take(), other.share());
+    }
+    BinaryOperationExpression<T> operator-(Expression<T>&& other) && {
+        return BinaryOperationExpression<T>(BinaryOperationExpression<T>::Type::SUB, this->take(), other.take());
+    }
+    BinaryOperationExpression<T> operator*(const Expression<T>& other) const& {
         return BinaryOperationExpression<T>(BinaryOperationExpression<T>::Type::MUL, *this, other);
     }
-    BinaryOperationExpression<T> operator/(const Expression<T>& other) const {
+    BinaryOperationExpression<T> operator*(Expression<T>&& other) const& {
+        return BinaryOperationExpression<T>(BinaryOperationExpression<T>::Type::MUL, this->share(), other.take());
+    }
+    BinaryOperationExpression<T> operator*(const Expression<T>& other) && {
+        return BinaryOperationExpression<T>(BinaryOperationExpression<T>::Type::MUL, this->take(), other.share());
+    }
+    BinaryOperationExpression<T> operator*(Expression<T>&& other) && {
+        return BinaryOperationExpression<T>(BinaryOperationExpression<T>::Type::MUL, this->take(), other.take());
+    }
+    BinaryOperationExpression<T> operator/(const Expression<T>& other) const& {
         return BinaryOperationExpression<T>(BinaryOperationExpression<T>::Type::DIV, *this, other);
     }
-    BinaryOperationExpression<T> operator^(const Expression<T>& other) const {
+    BinaryOperationExpression<T> operator/(Expression<T>&& other) const& {
+        return BinaryOperationExpression<T>(BinaryOperationExpression<T>::Type::DIV, this->share(), other.take());
+    }
+    BinaryOperationExpression<T> operator/(const Expression<T>& other) && {
+        return BinaryOperationExpression<T>(BinaryOperationExpression<T>::Type::DIV, this->take(), other.share());
+    }
+    BinaryOperationExpression<T> operator/(Expression<T>&& other) && {
+        return BinaryOperationExpression<T>(BinaryOperationExpression<T>::Type::DIV, this->take(), other.take());
+    }
+    BinaryOperationExpression<T> operator^(const Expression<T>& other) const& {
         return BinaryOperationExpression<T>(BinaryOperationExpression<T>::Type::POW, *this, other);
     }
+    BinaryOperationExpression<T> operator^(Expression<T>&& other) const& {
+        return BinaryOperationExpression<T>(BinaryOperationExpression<T>::Type::POW, this->share(), other.take());
+    }
+    BinaryOperationExpression<T> operator^(const Expression<T>& other) && {
+        return BinaryOperationExpression<T>(BinaryOperationExpression<T>::Type::POW, this->take(), other.share());
+    }
+    BinaryOperationExpression<T> operator^(Expression<T>&& other) && {
+        return BinaryOperationExpression<T>(BinaryOperationExpression<T>::Type::POW, this->take(), other.take());
+    }
 
-    UnaryOperationExpression<T> operator-() const {
+    UnaryOperationExpression<T> operator-() const& {
         return UnaryOperationExpression<T>(UnaryOperationExpression<T>::Type::INV, *this);
     }
+    UnaryOperationExpression<T> operator-() && {
+        return UnaryOperationExpression<T>(UnaryOperationExpression<T>::Type::INV, this->take());
+    }
     static UnaryOperationExpression<T> sin(const Expression<T>& other) {
         return UnaryOperationExpression<T>(UnaryOperationExpression<T>::Type::SIN, other);
     }
+    static UnaryOperationExpression<T> sin(Expression<T>&& other) {
+        return UnaryOperationExpression<T>(UnaryOperationExpression<T>::Type::SIN, other.take());
+    }
     static UnaryOperationExpression<T> cos(const Expression<T>& other) {
         return UnaryOperationExpression<T>(UnaryOperationExpression<T>::Type::COS, other);
     }
+    static UnaryOperationExpression<T> cos(Expression<T>&& other) {
+        return UnaryOperationExpression<T>(UnaryOperationExpression<T>::Type::COS, other.take());
+    }
     static UnaryOperationExpression<T> exp(const Expression<T>& other) {
         return UnaryOperationExpression<T>(UnaryOperationExpression<T>::Type::EXP, other);
     }
+    static UnaryOperationExpression<T> exp(Expression<T>&& other) {
+        return UnaryOperationExpression<T>(UnaryOperationExpression<T>::Type::EXP, other.take());
+    }
     static UnaryOperationExpression<T> ln(const Expression<T>& other) {
         return UnaryOperationExpression<T>(UnaryOperationExpression<T>::Type::LOG, other);
     }
+    static UnaryOperationExpression<T> ln(Expression<T>&& other) {
+        return UnaryOperationExpression<T>(UnaryOperationExpression<T>::Type::LOG, other.take());
+    }
+protected:
+    explicit Expression(Kind kind)
+        : node_kind(kind) {}
+private:
+    Kind node_kind;
 };
 template <typename T>
-class ConstExpression : public Expression<T> {
+std::ostream& operator<<(std::ostream& out, const Expression<T>& expr) {
+    expr.print(out);
+    return out;
+}
+
+template <typename T>
+class ConstExpression : public Expression<T>, private CountedNode<Statistics::CONSTANT_NODES> {
 public:
     T value;
     ~ConstExpression() = default;
+    ConstExpression(const ConstExpression&) = default;
+    ConstExpression(ConstExpression&&) = default;
     T eval(const std::unordered_map<std::string, T>& environment) const override {
         return value;
     }
+    T eval(const Environment<T>& environment) const override {
+        return value;
+    }
     ConstExpression(T val)
-        : value(val) {}
+        : Expression<T>(Expression<T>::CONSTANT),
+        value(val) {}
 
-    std::string to_string() const {
-        return to_string_modified(value);
+    void print(std::ostream& out) const override {
+        out << value;
     }
     std::shared_ptr<Expression<T>> clone() const override {
+        Statistics::count(Statistics::CLONES);
+        Statistics::count(Statistics::HEAP_ALLOCATIONS);
         return std::make_shared<ConstExpression<T>>(*this);
     }
-    std::shared_ptr<Expression<T>> substitute(const std::string& variable, T val) const override {
-        return clone();
+    std::shared_ptr<Expression<T>> steal() override {
+        Statistics::count(Statistics::CLONES);
+        Statistics::count(Statistics::HEAP_ALLOCATIONS);
+        return std::make_shared<ConstExpression<T>>(std::move(*this));
+    }
+    std::shared_ptr<Expression<T>> substitute(const std::string& variable, T val, bool fold_constants = false) const override {
+        ExpressionFactory<T> factory(false);
+        factory.fold_constants(fold_constants);
+        return substitute(SymbolTable::intern(variable), val, factory);
+    }
+    std::shared_ptr<Expression<T>> substitute(std::uint32_t variable, T val, ExpressionFactory<T>& factory) const override {
+        return this->share();
     }
     std::shared_ptr<Expression<T>> differentiate(const std::string& variable, bool& contains_variable) const override {
+        ExpressionFactory<T> factory(false);
+        return differentiate(SymbolTable::intern(variable), contains_variable, factory);
+    }
+    std::shared_ptr<Expression<T>> differentiate(std::uint32_t variable, bool& contains_variable, ExpressionFactory<T>& factory) const override {
         contains_variable = false;
-        return std::shared_ptr<Expression<T>>(std::make_shared<ConstExpression<T>>(0));
+        return factory.constant(0);
     }
     std::shared_ptr<Expression<T>> differentiate(const std::string& variable) const override {
         bool cv = false;
         return differentiate(variable, cv);
     }
-private:
-    static std::string to_string_modified(const T num) {
-        std::ostringstream oss;
-        oss << num;
-        return oss.str();
-    }
-    template<typename Y>
-    static std::string to_string_modified(const std::complex<Y> num) {
-        std::ostringstream oss;
-        oss << num.real();
-        if (num.imag() < 0)
-            oss << "-";
-        else
-            oss << "+";
-        oss << std::abs(num.imag()) << "i";
-        return oss.str();
+    std::shared_ptr<Expression<T>> simplify() const override {
+        ExpressionFactory<T> factory;
+        return factory.simplify(this->share());
     }
-    template<typename Y>
-    bool is_complex(const Y&) {
-        return false;
+    std::shared_ptr<Expression<T>> simplify(ExpressionFactory<T>& factory) const override {
+        return factory.constant(value);
+    }
+    static const ConstExpression<T>* match(const std::shared_ptr<Expression<T>>& expr) {
+        return dynamic_cast<const ConstExpression<T>*>(expr.get());
+    }
+    void compile_into(CompiledExpression<T>& tape) const override {
+        tape.emit_constant(value);
     }
-
 };
 template <typename T>
-class UnaryOperationExpression : public Expression<T> {
+class UnaryOperationExpression : public Expression<T>, private CountedNode<Statistics::UNARY_NODES> {
 public:
     enum Type { INV, EXP, SIN, COS, LOG };
     Type type;
     std::shared_ptr<Expression<T>> operand;
-    ~UnaryOperationExpression() = default;
+    ~UnaryOperationExpression() {
+        Traversal<T>::release(operand);
+    }
+    UnaryOperationExpression(const UnaryOperationExpression&) = default;
+    UnaryOperationExpression(UnaryOperationExpression&&) = default;
     T eval(const std::unordered_map<std::string, T>& environment) const override {
-        switch (type) {
-        case INV: return -operand->eval(environment);
-        case EXP: return std::exp(operand->eval(environment));
-        case SIN: return std::sin(operand->eval(environment));
-        case COS: return std::cos(operand->eval(environment));
-        case LOG: return std::log(operand->eval(environment));
+        return eval(Environment<T>(environment));
+    }
+    T eval(const Environment<T>& environment) const override {
+        return Traversal<T>::eval(*this, environment);
+    }
+    static T apply(Type op_type, const T& a) {
+        switch (op_type) {
+        case INV: return -a;
+        case EXP: return Elementary<T>::exp(a);
+        case SIN: return Elementary<T>::sin(a);
+        case COS: return Elementary<T>::cos(a);
+        case LOG: return Elementary<T>::log(a);
         default: throw std::runtime_error("Unknown unary operation");
         };
     }
     UnaryOperationExpression(Type op_type, const Expression<T>& expr)
-        : type(op_type),
-        operand(expr.clone()) {}
-    std::string to_string() const override {
-        switch (type) {
-        case INV: return "(-" + operand->to_string() + ")";
-        case EXP: return "exp(" + operand->to_string() + ")";
-        case SIN: return "sin(" + operand->to_string() + ")";
-        case COS: return "cos(" + operand->to_string() + ")";
-        case LOG: return "log(" + operand->to_string() + ")";
+        : Expression<T>(Expression<T>::UNARY),
+        type(op_type),
+        operand(expr.share()) {}
+    UnaryOperationExpression(Type op_type, std::shared_ptr<Expression<T>> expr)
+        : Expression<T>(Expression<T>::UNARY),
+        type(op_type),
+        operand(std::move(expr)) {}
+    void print(std::ostream& out) const override {
+        Traversal<T>::print(out, *this);
+    }
+    // Text printed before the operand; the closing parenthesis follows it.
+    static const char* prefix(Type op_type) {
+        switch (op_type) {
+        case INV: return "(-";
+        case EXP: return "exp(";
+        case SIN: return "sin(";
+        case COS: return "cos(";
+        case LOG: return "log(";
         default: throw std::runtime_error("Unknown unary operation");
         };
     }
     std::shared_ptr<Expression<T>> clone() const override {
+        Statistics::count(Statistics::CLONES);
+        Statistics::count(Statistics::HEAP_ALLOCATIONS);
         return std::make_shared<UnaryOperationExpression<T>>(*this);
     }
-    std::shared_ptr<Expression<T>> substitute(const std::string& variable, T val) const override {
-        return std::make_shared<UnaryOperationExpression<T>>(type, *operand->substitute(variable, val));
+    std::shared_ptr<Expression<T>> steal() override {
+        Statistics::count(Statistics::CLONES);
+        Statistics::count(Statistics::HEAP_ALLOCATIONS);
+        return std::make_shared<UnaryOperationExpression<T>>(std::move(*this));
+    }
+    std::shared_ptr<Expression<T>> substitute(const std::string& variable, T val, bool fold_constants = false) const override {
+        ExpressionFactory<T> factory(false);
+        factory.fold_constants(fold_constants);
+        return substitute(SymbolTable::intern(variable), val, factory);
+    }
+    std::shared_ptr<Expression<T>> substitute(std::uint32_t variable, T val, ExpressionFactory<T>& factory) const override {
+        auto sub = factory.substitute(operand, variable, val);
+        if (factory.folds_constants() && ConstExpression<T>::match(sub))
+            return factory.constant(UnaryOperationExpression<T>(type, sub).eval(Environment<T>()));
+        if (sub == operand)
+            return this->share();
+        return factory.unary(type, sub);
     }
     std::shared_ptr<Expression<T>> differentiate(const std::string& variable, bool& contains_variable) const override {
-        auto diff = operand->differentiate(variable, contains_variable);
+        ExpressionFactory<T> factory(false);
+        return differentiate(SymbolTable::intern(variable), contains_variable, factory);
+    }
+    std::shared_ptr<Expression<T>> differentiate(std::uint32_t variable, bool& contains_variable, ExpressionFactory<T>& factory) const override {
+        using B = BinaryOperationExpression<T>;
+        auto diff = factory.differentiate(operand, variable, contains_variable);
         if (!contains_variable)
-            return std::shared_ptr<Expression<T>>(std::make_shared<ConstExpression<T>>(0));
+            return factory.constant(0);
         switch (type) {
-        case INV: return std::make_shared<UnaryOperationExpression<T>>(-*diff);
-        case EXP: return std::make_shared<BinaryOperationExpression<T>>(UnaryOperationExpression<T>(EXP, *operand) * (*diff));
-        case SIN: return std::make_shared<BinaryOperationExpression<T>>(UnaryOperationExpression<T>(COS, *operand) * (*diff));
-        case COS: return std::make_shared<BinaryOperationExpression<T>>((-UnaryOperationExpression<T>(SIN, *operand)) * (*diff));
-        case LOG: return std::make_shared<BinaryOperationExpression<T>>(((ConstExpression<T>(1) / *operand)) * (*diff));
+        case INV: return factory.unary(INV, diff);
+        case EXP: return factory.binary(B::MUL, factory.unary(EXP, operand), diff);
+        case SIN: return factory.binary(B::MUL, factory.unary(COS, operand), diff);
+        case COS: return factory.binary(B::MUL, factory.unary(INV, factory.unary(SIN, operand)), diff);
+        case LOG: return factory.binary(B::MUL, factory.binary(B::DIV, factory.constant(1), operand), diff);
         default: throw std::runtime_error("Unknown unary operation");
         };
     }
@@ -156,59 +702,130 @@ public:
         bool cv = false;
         return differentiate(variable, cv);
     }
+    std::shared_ptr<Expression<T>> simplify() const override {
+        ExpressionFactory<T> factory;
+        return factory.simplify(this->share());
+    }
+    std::shared_ptr<Expression<T>> simplify(ExpressionFactory<T>& factory) const override {
+        return fold(type, factory.simplify(operand), factory);
+    }
+    static const UnaryOperationExpression<T>* match(const std::shared_ptr<Expression<T>>& expr, Type op_type) {
+        auto unary = dynamic_cast<const UnaryOperationExpression<T>*>(expr.get());
+        return unary && unary->type == op_type ? unary : nullptr;
+    }
+    // Builds op_type(a) from an already simplified operand.
+    static std::shared_ptr<Expression<T>> fold(Type op_type, const std::shared_ptr<Expression<T>>& a, ExpressionFactory<T>& factory) {
+        if (ConstExpression<T>::match(a))
+            return factory.constant(UnaryOperationExpression<T>(op_type, a).eval(Environment<T>()));
+        if (op_type == INV)
+            if (auto inner = match(a, INV))
+                return inner->operand;
+        return factory.unary(op_type, a);
+    }
+    void compile_into(CompiledExpression<T>& tape) const override {
+        Traversal<T>::compile(tape, *this);
+    }
 };
 template <typename T>
-class BinaryOperationExpression : public Expression<T> {
+class BinaryOperationExpression : public Expression<T>, private CountedNode<Statistics::BINARY_NODES> {
 public:
     enum Type { ADD, SUB, MUL, DIV, POW };
     Type type;
     std::shared_ptr<Expression<T>> operand_left, operand_right;
-    ~BinaryOperationExpression() = default;
+    ~BinaryOperationExpression() {
+        Traversal<T>::release(operand_left);
+        Traversal<T>::release(operand_right);
+    }
+    BinaryOperationExpression(const BinaryOperationExpression&) = default;
+    BinaryOperationExpression(BinaryOperationExpression&&) = default;
     T eval(const std::unordered_map<std::string, T>& environment) const override {
-        switch (type) {
-        case ADD: return operand_left->eval(environment) + operand_right->eval(environment);
-        case SUB: return operand_left->eval(environment) - operand_right->eval(environment);
-        case MUL: return operand_left->eval(environment) * operand_right->eval(environment);
-        case DIV: return operand_left->eval(environment) / operand_right->eval(environment);
-        case POW: return std::exp(operand_right->eval(environment) * std::log(operand_left->eval(environment)));
+        return eval(Environment<T>(environment));
+    }
+    T eval(const Environment<T>& environment) const override {
+        return Traversal<T>::eval(*this, environment);
+    }
+    // POW with a constant exponent goes through Elementary::power instead.
+    static T apply(Type op_type, const T& a, const T& b) {
+        switch (op_type) {
+        case ADD: return a + b;
+        case SUB: return a - b;
+        case MUL: return a * b;
+        case DIV: return a / b;
+        case POW: return Elementary<T>::pow(a, b);
         default: throw std::runtime_error("Unknown binary operation");
         }
     }
     BinaryOperationExpression(Type op_type, const Expression<T>& expr_left, const Expression<T>& expr_right)
-        : type(op_type),
-        operand_left(expr_left.clone()),
-        operand_right(expr_right.clone()) {}
-    std::string to_string() const override {
-        switch (type) {
-        case ADD: return "(" + operand_left->to_string() + " + " + operand_right->to_string() + ")";
-        case SUB: return "(" + operand_left->to_string() + " - " + operand_right->to_string() + ")";
-        case MUL: return "(" + operand_left->to_string() + " * " + operand_right->to_string() + ")";
-        case DIV: return "(" + operand_left->to_string() + " / " + operand_right->to_string() + ")";
-        case POW: return "(" + operand_left->to_string() + " ^ " + operand_right->to_string() + ")";
+        : Expression<T>(Expression<T>::BINARY),
+        type(op_type),
+        operand_left(expr_left.share()),
+        operand_right(expr_right.share()) {}
+    BinaryOperationExpression(Type op_type, std::shared_ptr<Expression<T>> expr_left, std::shared_ptr<Expression<T>> expr_right)
+        : Expression<T>(Expression<T>::BINARY),
+        type(op_type),
+        operand_left(std::move(expr_left)),
+        operand_right(std::move(expr_right)) {}
+    void print(std::ostream& out) const override {
+        Traversal<T>::print(out, *this);
+    }
+    static const char* symbol(Type op_type) {
+        switch (op_type) {
+        case ADD: return " + ";
+        case SUB: return " - ";
+        case MUL: return " * ";
+        case DIV: return " / ";
+        case POW: return " ^ ";
         default: throw std::runtime_error("Unknown binary operation");
         };
     }
     std::shared_ptr<Expression<T>> clone() const override {
+        Statistics::count(Statistics::CLONES);
+        Statistics::count(Statistics::HEAP_ALLOCATIONS);
         return std::make_shared<BinaryOperationExpression<T>>(*this);
     }
+    std::shared_ptr<Expression<T>> steal() override {
+        Statistics::count(Statistics::CLONES);
+        Statistics::count(Statistics::HEAP_ALLOCATIONS);
+        return std::make_shared<BinaryOperationExpression<T>>(std::move(*this));
+    }
 
-    std::shared_ptr<Expression<T>> substitute(const std::string& variable, T val) const override {
-        return std::make_shared<BinaryOperationExpression<T>>(type, *operand_left->substitute(variable, val), *operand_right->substitute(variable, val));
+    std::shared_ptr<Expression<T>> substitute(const std::string& variable, T val, bool fold_constants = false) const override {
+        ExpressionFactory<T> factory(false);
+        factory.fold_constants(fold_constants);
+        return substitute(SymbolTable::intern(variable), val, factory);
+    }
+    std::shared_ptr<Expression<T>> substitute(std::uint32_t variable, T val, ExpressionFactory<T>& factory) const override {
+        auto sub_l = factory.substitute(operand_left, variable, val);
+        auto sub_r = factory.substitute(operand_right, variable, val);
+        if (factory.folds_constants() && ConstExpression<T>::match(sub_l) && ConstExpression<T>::match(sub_r))
+            return factory.constant(BinaryOperationExpression<T>(type, sub_l, sub_r).eval(Environment<T>()));
+        if (sub_l == operand_left && sub_r == operand_right)
+            return this->share();
+        return factory.binary(type, sub_l, sub_r);
     }
     std::shared_ptr<Expression<T>> differentiate(const std::string& variable, bool& contains_variable) const override {
+        ExpressionFactory<T> factory(false);
+        return differentiate(SymbolTable::intern(variable), contains_variable, factory);
+    }
+    std::shared_ptr<Expression<T>> differentiate(std::uint32_t variable, bool& contains_variable, ExpressionFactory<T>& factory) const override {
+        using U = UnaryOperationExpression<T>;
         bool cv_l = false;
-        auto diff_l = operand_left->differentiate(variable, cv_l);
+        auto diff_l = factory.differentiate(operand_left, variable, cv_l);
         bool cv_r = false;
-        auto diff_r = operand_right->differentiate(variable, cv_r);
+        auto diff_r = factory.differentiate(operand_right, variable, cv_r);
         contains_variable = cv_l || cv_r;
         if (!contains_variable)
-            return std::shared_ptr<Expression<T>>(std::make_shared<ConstExpression<T>>(0));
+            return factory.constant(0);
+        const auto& l = operand_left;
+        const auto& r = operand_right;
         switch (type) {
-        case ADD: return std::make_shared<BinaryOperationExpression<T>>(*diff_l + *diff_r);
-        case SUB: return std::make_shared<BinaryOperationExpression<T>>(*diff_l - *diff_r);
-        case MUL: return std::make_shared<BinaryOperationExpression<T>>(((*diff_l) * (*operand_right)) + ((*operand_left) * (*diff_r)));
-        case DIV: return std::make_shared<BinaryOperationExpression<T>>((((*diff_l) * (*operand_left)) - ((*operand_left) * (*diff_r))) / ((*operand_right) * (*operand_right)));
-        case POW: return std::make_shared<BinaryOperationExpression<T>>(((*operand_right) * ((*operand_left) ^ (*operand_right - ConstExpression<T>(1))) * (*diff_l)) - ((((*operand_left) ^ (*operand_right)) * (*diff_r)) * UnaryOperationExpression<T>(UnaryOperationExpression<T>::Type::LOG, *operand_left)));
+        case ADD: return factory.binary(ADD, diff_l, diff_r);
+        case SUB: return factory.binary(SUB, diff_l, diff_r);
+        case MUL: return factory.binary(ADD, factory.binary(MUL, diff_l, r), factory.binary(MUL, l, diff_r));
+        case DIV: return factory.binary(DIV, factory.binary(SUB, factory.binary(MUL, diff_l, r), factory.binary(MUL, l, diff_r)), factory.binary(MUL, r, r));
+        case POW: return factory.binary(ADD,
+            factory.binary(MUL, factory.binary(MUL, r, factory.binary(POW, l, factory.binary(SUB, r, factory.constant(1)))), diff_l),
+            factory.binary(MUL, factory.binary(MUL, factory.binary(POW, l, r), diff_r), factory.unary(U::LOG, l)));
         default: throw std::runtime_error("Unknown unary operation");
         };
     }
@@ -216,40 +833,1357 @@ public:
         bool cv = false;
         return differentiate(variable, cv);
     }
+    std::shared_ptr<Expression<T>> simplify() const override {
+        ExpressionFactory<T> factory;
+        return factory.simplify(this->share());
+    }
+    std::shared_ptr<Expression<T>> simplify(ExpressionFactory<T>& factory) const override {
+        return fold(type, factory.simplify(operand_left), factory.simplify(operand_right), factory);
+    }
+    static const BinaryOperationExpression<T>* match(const std::shared_ptr<Expression<T>>& expr, Type op_type) {
+        auto binary = dynamic_cast<const BinaryOperationExpression<T>*>(expr.get());
+        return binary && binary->type == op_type ? binary : nullptr;
+    }
+    // Builds `a op_type b` from already simplified, hash-consed operands, so
+    // structurally equal subtrees compare equal by pointer. Every rule does a
+    // constant amount of work.
+    static std::shared_ptr<Expression<T>> fold(Type op_type, const std::shared_ptr<Expression<T>>& a, const std::shared_ptr<Expression<T>>& b, ExpressionFactory<T>& factory) {
+        using U = UnaryOperationExpression<T>;
+        auto ca = ConstExpression<T>::match(a);
+        auto cb = ConstExpression<T>::match(b);
+        if (ca && cb)
+            return factory.constant(BinaryOperationExpression<T>(op_type, a, b).eval(Environment<T>()));
+        switch (op_type) {
+        case ADD: {
+            if (ca && ca->value == T(0)) return b;
+            if (cb && cb->value == T(0)) return a;
+            if (ca) return fold(ADD, b, a, factory);
+            if (auto inner = match(a, ADD))
+                if (auto c = ConstExpression<T>::match(inner->operand_right); c && cb)
+                    return fold(ADD, inner->operand_left, factory.constant(c->value + cb->value), factory);
+            if (auto inv = U::match(b, U::INV))
+                return fold(SUB, a, inv->operand, factory);
+            auto ta = split_term(a, factory), tb = split_term(b, factory);
+            if (ta.second == tb.second)
+                return fold(MUL, factory.constant(ta.first + tb.first), ta.second, factory);
+            if (auto inner = match(a, ADD); inner && !match(inner->operand_right, ADD))
+                if (split_term(inner->operand_right, factory).second == tb.second)
+                    return fold(ADD, inner->operand_left, fold(ADD, inner->operand_right, b, factory), factory);
+            break;
+        }
+        case SUB: {
+            if (cb && cb->value == T(0)) return a;
+            if (ca && ca->value == T(0)) return U::fold(U::INV, b, factory);
+            if (a == b) return factory.constant(0);
+            if (auto inv = U::match(b, U::INV))
+                return fold(ADD, a, inv->operand, factory);
+            auto ta = split_term(a, factory), tb = split_term(b, factory);
+            if (ta.second == tb.second)
+                return fold(MUL, factory.constant(ta.first - tb.first), ta.second, factory);
+            break;
+        }
+        case MUL: {
+            if ((ca && ca->value == T(0)) || (cb && cb->value == T(0))) return factory.constant(0);
+            if (ca && ca->value == T(1)) return b;
+            if (cb && cb->value == T(1)) return a;
+            if (cb) return fold(MUL, b, a, factory);
+            if (ca && ca->value == T(-1)) return U::fold(U::INV, b, factory);
+            if (auto inner = match(b, MUL))
+                if (auto c = ConstExpression<T>::match(inner->operand_left))
+                    return ca ? fold(MUL, factory.constant(ca->value * c->value), inner->operand_right, factory)
+                              : fold(MUL, inner->operand_left, fold(MUL, a, inner->operand_right, factory), factory);
+            if (auto inner = match(a, MUL); inner && !ca)
+                if (ConstExpression<T>::match(inner->operand_left))
+                    return fold(MUL, inner->operand_left, fold(MUL, inner->operand_right, b, factory), factory);
+            // x * x stays a product. A POW node would also evaluate exactly, but
+            // its derivative carries an l^r * 0 * log(l) term that is NaN for
+            // negative reals until simplified again, and the product is cheaper.
+            if (is_power(a) || is_power(b)) {
+                auto pa = split_power(a, factory), pb = split_power(b, factory);
+                if (pa.first == pb.first)
+                    return fold(POW, pa.first, fold(ADD, pa.second, pb.second, factory), factory);
+            }
+            break;
+        }
+        case DIV: {
+            if (cb && cb->value == T(1)) return a;
+            if (ca && ca->value == T(0)) return factory.constant(0);
+            if (a == b) return factory.constant(1);
+            if (is_power(a) || is_power(b)) {
+                auto pa = split_power(a, factory), pb = split_power(b, factory);
+                if (pa.first == pb.first)
+                    return fold(POW, pa.first, fold(SUB, pa.second, pb.second, factory), factory);
+            }
+            break;
+        }
+        case POW: {
+            if (cb && cb->value == T(0)) return factory.constant(1);
+            if (cb && cb->value == T(1)) return a;
+            if (ca && ca->value == T(1)) return factory.constant(1);
+            // (x ^ p) ^ q == x ^ (p * q) on every branch only for integer q.
+            if (auto inner = match(a, POW); inner && cb && is_integer(cb->value))
+                return fold(POW, inner->operand_left, fold(MUL, inner->operand_right, b, factory), factory);
+            break;
+        }
+        default: throw std::runtime_error("Unknown binary operation");
+        }
+        return factory.binary(op_type, a, b);
+    }
+    void compile_into(CompiledExpression<T>& tape) const override {
+        Traversal<T>::compile(tape, *this);
+    }
+private:
+    // c * x -> (c, x), -x -> (-1, x), x -> (1, x)
+    static std::pair<T, std::shared_ptr<Expression<T>>> split_term(const std::shared_ptr<Expression<T>>& expr, ExpressionFactory<T>& factory) {
+        if (auto product = match(expr, MUL))
+            if (auto c = ConstExpression<T>::match(product->operand_left))
+                return { c->value, product->operand_right };
+        if (auto inv = UnaryOperationExpression<T>::match(expr, UnaryOperationExpression<T>::INV))
+            return { T(-1), inv->operand };
+        return { T(1), expr };
+    }
+    // x ^ p -> (x, p), 1 / x ^ p -> (x, -p), x -> (x, 1)
+    static std::pair<std::shared_ptr<Expression<T>>, std::shared_ptr<Expression<T>>> split_power(const std::shared_ptr<Expression<T>>& expr, ExpressionFactory<T>& factory) {
+        if (auto power = match(expr, POW))
+            return { power->operand_left, power->operand_right };
+        if (auto reciprocal = match(expr, DIV))
+            if (auto c = ConstExpression<T>::match(reciprocal->operand_left); c && c->value == T(1)) {
+                auto inner = split_power(reciprocal->operand_right, factory);
+                return { inner.first, UnaryOperationExpression<T>::fold(UnaryOperationExpression<T>::INV, inner.second, factory) };
+            }
+        return { expr, factory.constant(1) };
+    }
+    static bool is_power(const std::shared_ptr<Expression<T>>& expr) {
+        if (match(expr, POW))
+            return true;
+        auto reciprocal = match(expr, DIV);
+        return reciprocal && ConstExpression<T>::match(reciprocal->operand_left) && match(reciprocal->operand_right, POW);
+    }
+    template <typename Y>
+    static bool is_integer(const Y& value) {
+        return std::isfinite(value) && value == std::round(value);
+    }
+    template <typename Y>
+    static bool is_integer(const std::complex<Y>& value) {
+        return value.imag() == 0 && std::isfinite(value.real()) && value.real() == std::round(value.real());
+    }
 };
 
 template <typename T>
-class VariableExpression : public Expression<T> {
+class VariableExpression : public Expression<T>, private CountedNode<Statistics::VARIABLE_NODES> {
 public:
     std::string name;
+    std::uint32_t symbol; // SymbolTable id of name
     ~VariableExpression() = default;
+    VariableExpression(const VariableExpression&) = default;
+    VariableExpression(VariableExpression&&) = default;
     virtual T eval(const std::unordered_map<std::string, T>& environment)  const override {
         if (environment.find(name) == environment.end())
             throw std::runtime_error("Unknown variable: " + name);
         else
             return environment.find(name)->second;
     }
+    T eval(const Environment<T>& environment) const override {
+        return environment.get(symbol);
+    }
     VariableExpression(const std::string& var_name)
-        : name(var_name) {};
-    std::string to_string()  const override {
-        return name;
+        : Expression<T>(Expression<T>::VARIABLE),
+        name(var_name),
+        symbol(SymbolTable::intern(var_name)) {};
+    VariableExpression(const std::string& var_name, std::uint32_t var_symbol)
+        : Expression<T>(Expression<T>::VARIABLE),
+        name(var_name),
+        symbol(var_symbol) {};
+    void print(std::ostream& out) const override {
+        out << name;
     }
     std::shared_ptr<Expression<T>> clone() const override {
+        Statistics::count(Statistics::CLONES);
+        Statistics::count(Statistics::HEAP_ALLOCATIONS);
         return std::make_shared<VariableExpression<T>>(*this);
     }
-    std::shared_ptr<Expression<T>> substitute(const std::string& variable, T val) const override {
-        if (variable == name)
-            return std::shared_ptr<Expression<T>>(std::make_shared<ConstExpression<T>>(val));
+    std::shared_ptr<Expression<T>> steal() override {
+        Statistics::count(Statistics::CLONES);
+        Statistics::count(Statistics::HEAP_ALLOCATIONS);
+        return std::make_shared<VariableExpression<T>>(std::move(*this));
+    }
+    std::shared_ptr<Expression<T>> substitute(const std::string& variable, T val, bool fold_constants = false) const override {
+        ExpressionFactory<T> factory(false);
+        factory.fold_constants(fold_constants);
+        return substitute(SymbolTable::intern(variable), val, factory);
+    }
+    std::shared_ptr<Expression<T>> substitute(std::uint32_t variable, T val, ExpressionFactory<T>& factory) const override {
+        if (variable == symbol)
+            return factory.constant(val);
         else
-            return clone();
+            return this->share();
     }
     std::shared_ptr<Expression<T>> differentiate(const std::string& variable, bool& contains_variable) const override {
-        contains_variable = (name == variable);
-        //return (contains_variable) ? std::shared_ptr<Expression<T>>(std::make_shared<ConstExpression<T>>(1)) : std::shared_ptr<Expression<T>>(std::make_shared<ConstExpression<T>>(0));
-        return std::shared_ptr<Expression<T>>(std::make_shared<ConstExpression<T>>((contains_variable) ? 1 : 0));
+        ExpressionFactory<T> factory(false);
+        return differentiate(SymbolTable::intern(variable), contains_variable, factory);
+    }
+    std::shared_ptr<Expression<T>> differentiate(std::uint32_t variable, bool& contains_variable, ExpressionFactory<T>& factory) const override {
+        contains_variable = (symbol == variable);
+        return factory.constant((contains_variable) ? 1 : 0);
     }
     std::shared_ptr<Expression<T>> differentiate(const std::string& variable) const override {
         bool cv = false;
         return differentiate(variable, cv);
     }
+    std::shared_ptr<Expression<T>> simplify() const override {
+        ExpressionFactory<T> factory;
+        return factory.simplify(this->share());
+    }
+    std::shared_ptr<Expression<T>> simplify(ExpressionFactory<T>& factory) const override {
+        return factory.variable(name);
+    }
+    void compile_into(CompiledExpression<T>& tape) const override {
+        tape.emit_variable(name, symbol);
+    }
 };
+
+// Explicit-stack versions of the tree walks behind eval(), print(),
+// compile_into() and the node destructors. Each visits every node of the
+// tree (shared subtrees once per use, as the recursive walks did) with O(1)
+// call depth, so a million-level chain needs heap memory for the stack but
+// no extra call stack. Operands are visited left to right. The stacks are
+// per-thread scratch, reused across calls: none of the walks re-enters
+// itself, and shallow trees allocate nothing.
+template <typename T>
+struct Traversal {
+    static constexpr size_t max_release_depth = 256;
+    using C = ConstExpression<T>;
+    using V = VariableExpression<T>;
+    using U = UnaryOperationExpression<T>;
+    using B = BinaryOperationExpression<T>;
+
+    // Walks down each left spine, keeping the value of the last finished
+    // subtree in a local and stacking only the operators still waiting for
+    // it. Left operand values wait in `operands` while a right operand that
+    // is not a leaf is evaluated.
+    static T eval(const Expression<T>& root, const Environment<T>& environment) {
+        struct Frame {
+            const Expression<T>* node;
+            bool binary;
+            bool right_done;
+        };
+        thread_local std::vector<Frame> frames;
+        thread_local std::vector<T> values;
+        std::vector<Frame>& stack = frames;
+        std::vector<T>& operands = values;
+        stack.clear();
+        operands.clear();
+        auto leaf = [&](const Expression<T>* node) {
+            return node->kind() == Expression<T>::CONSTANT ? static_cast<const C*>(node)->value
+                                                           : environment.get(static_cast<const V*>(node)->symbol);
+        };
+        const Expression<T>* node = &root;
+        T value;
+        for (;;) {
+            for (;;) {
+                typename Expression<T>::Kind kind = node->kind();
+                if (kind == Expression<T>::UNARY) {
+                    stack.push_back({ node, false, false });
+                    node = static_cast<const U*>(node)->operand.get();
+                }
+                else if (kind == Expression<T>::BINARY) {
+                    stack.push_back({ node, true, false });
+                    node = static_cast<const B*>(node)->operand_left.get();
+                }
+                else {
+                    value = leaf(node);
+                    break;
+                }
+            }
+            for (;;) {
+                if (stack.empty()) {
+                    trim(stack);
+                    trim(operands);
+                    return value;
+                }
+                Frame& frame = stack.back();
+                if (!frame.binary)
+                    value = U::apply(static_cast<const U*>(frame.node)->type, value);
+                else {
+                    auto binary = static_cast<const B*>(frame.node);
+                    const Expression<T>* right = binary->operand_right.get();
+                    if (frame.right_done) {
+                        value = apply(binary, operands.back(), value);
+                        operands.pop_back();
+                    }
+                    else if (right->kind() == Expression<T>::CONSTANT || right->kind() == Expression<T>::VARIABLE)
+                        value = apply(binary, value, leaf(right));
+                    else {
+                        frame.right_done = true;
+                        operands.push_back(value);
+                        node = right;
+                        break;
+                    }
+                }
+                stack.pop_back();
+            }
+        }
+    }
+    static void print(std::ostream& out, const Expression<T>& root) {
+        // Each entry prints its text, then its node if there is one; left
+        // operands are printed straight away while walking down the spine.
+        thread_local std::vector<std::pair<const char*, const Expression<T>*>> stack;
+        stack.assign(1, { "", &root });
+        while (!stack.empty()) {
+            auto [text, node] = stack.back();
+            stack.pop_back();
+            out << text;
+            while (node) {
+                switch (node->kind()) {
+                case Expression<T>::UNARY: {
+                    auto unary = static_cast<const U*>(node);
+                    out << U::prefix(unary->type);
+                    stack.push_back({ ")", nullptr });
+                    node = unary->operand.get();
+                    break;
+                }
+                case Expression<T>::BINARY: {
+                    auto binary = static_cast<const B*>(node);
+                    out << '(';
+                    stack.push_back({ ")", nullptr });
+                    stack.push_back({ B::symbol(binary->type), binary->operand_right.get() });
+                    node = binary->operand_left.get();
+                    break;
+                }
+                default:
+                    node->print(out);
+                    node = nullptr;
+                }
+            }
+        }
+        trim(stack);
+    }
+    // Same walk as eval(); a frame is flagged once its right operand is
+    // being emitted.
+    static void compile(CompiledExpression<T>& tape, const Expression<T>& root) {
+        thread_local std::vector<std::pair<const Expression<T>*, bool>> frames;
+        std::vector<std::pair<const Expression<T>*, bool>>& stack = frames;
+        stack.clear();
+        auto leaf = [&](const Expression<T>* node) {
+            if (node->kind() == Expression<T>::CONSTANT)
+                tape.emit_constant(static_cast<const C*>(node)->value);
+            else
+                tape.emit_variable(static_cast<const V*>(node)->name, static_cast<const V*>(node)->symbol);
+        };
+        const Expression<T>* node = &root;
+        for (;;) {
+            for (;;) {
+                typename Expression<T>::Kind kind = node->kind();
+                if (kind == Expression<T>::UNARY) {
+                    stack.push_back({ node, false });
+                    node = static_cast<const U*>(node)->operand.get();
+                }
+                else if (kind == Expression<T>::BINARY) {
+                    stack.push_back({ node, false });
+                    node = static_cast<const B*>(node)->operand_left.get();
+                }
+                else {
+                    leaf(node);
+                    break;
+                }
+            }
+            for (;;) {
+                if (stack.empty()) {
+                    trim(stack);
+                    return;
+                }
+                auto& [operation, right_done] = stack.back();
+                if (operation->kind() == Expression<T>::UNARY)
+                    tape.emit_unary(static_cast<const U*>(operation)->type);
+                else {
+                    auto binary = static_cast<const B*>(operation);
+                    const Expression<T>* right = binary->operand_right.get();
+                    if (!right_done && right->kind() != Expression<T>::CONSTANT && right->kind() != Expression<T>::VARIABLE) {
+                        right_done = true;
+                        node = right;
+                        break;
+                    }
+                    if (!right_done)
+                        leaf(right);
+                    tape.emit_binary(binary->type);
+                }
+                stack.pop_back();
+            }
+        }
+    }
+    static T apply(const B* binary, const T& left, const T& right) {
+        if (binary->type == B::POW && binary->operand_right->kind() == Expression<T>::CONSTANT)
+            return Elementary<T>::power(left, right);
+        return B::apply(binary->type, left, right);
+    }
+    // Returns the memory of a scratch stack that a very deep tree grew.
+    template <typename Item>
+    static void trim(std::vector<Item>& scratch) {
+        if (scratch.capacity() > 4096) {
+            scratch.clear();
+            scratch.shrink_to_fit();
+        }
+    }
+    // Drops an operand reference. Nested destructors release operands
+    // normally up to max_release_depth levels; below that, a subtree losing
+    // its last reference is taken apart from an explicit stack: every node
+    // gives up the operands it solely owns before it is destroyed, so no
+    // destructor there releases more than one level.
+    static void release(std::shared_ptr<Expression<T>>& operand) {
+        thread_local size_t depth = 0;
+        if (depth < max_release_depth) {
+            depth++;
+            operand.reset();
+            depth--;
+            return;
+        }
+        if (!operand || operand.use_count() != 1)
+            return;
+        std::vector<std::shared_ptr<Expression<T>>> pending;
+        pending.push_back(std::move(operand));
+        while (!pending.empty()) {
+            std::shared_ptr<Expression<T>> node = std::move(pending.back());
+            pending.pop_back();
+            auto detach = [&](std::shared_ptr<Expression<T>>& child) {
+                if (child && child.use_count() == 1)
+                    pending.push_back(std::move(child));
+            };
+            switch (node->kind()) {
+            case Expression<T>::UNARY:
+                detach(static_cast<U*>(node.get())->operand);
+                break;
+            case Expression<T>::BINARY:
+                detach(static_cast<B*>(node.get())->operand_left);
+                detach(static_cast<B*>(node.get())->operand_right);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+};
+
+// Linear in the number of distinct nodes, with an explicit stack so deep
+// trees cannot overflow the call stack.
+template <typename T>
+ExpressionShape expression_shape(const std::vector<const Expression<T>*>& roots) {
+    using U = UnaryOperationExpression<T>;
+    using B = BinaryOperationExpression<T>;
+    std::unordered_map<const Expression<T>*, std::pair<size_t, size_t>> seen; // node -> size, depth
+    std::vector<std::pair<const Expression<T>*, bool>> stack;
+    ExpressionShape shape{ 0, 0, 0 };
+    auto saturating_add = [](size_t a, size_t b) { return a > SIZE_MAX - b ? SIZE_MAX : a + b; };
+    for (const Expression<T>* root : roots) {
+        stack.push_back({ root, false });
+        while (!stack.empty()) {
+            auto [expr, expanded] = stack.back();
+            if (seen.count(expr)) {
+                stack.pop_back();
+                continue;
+            }
+            auto unary = dynamic_cast<const U*>(expr);
+            auto binary = dynamic_cast<const B*>(expr);
+            if (!expanded && (unary || binary)) {
+                stack.back().second = true;
+                if (unary)
+                    stack.push_back({ unary->operand.get(), false });
+                else {
+                    stack.push_back({ binary->operand_right.get(), false });
+                    stack.push_back({ binary->operand_left.get(), false });
+                }
+                continue;
+            }
+            stack.pop_back();
+            std::pair<size_t, size_t> node{ 1, 1 };
+            if (unary) {
+                const auto& operand = seen.at(unary->operand.get());
+                node = { saturating_add(operand.first, 1), operand.second + 1 };
+            }
+            else if (binary) {
+                const auto& left = seen.at(binary->operand_left.get());
+                const auto& right = seen.at(binary->operand_right.get());
+                node = { saturating_add(saturating_add(left.first, right.first), 1), std::max(left.second, right.second) + 1 };
+            }
+            seen.emplace(expr, node);
+        }
+        const auto& node = seen.at(root);
+        shape.size = saturating_add(shape.size, node.first);
+        shape.depth = std::max(shape.depth, node.second);
+    }
+    shape.distinct = seen.size();
+    return shape;
+}
+template <typename T>
+ExpressionShape expression_shape(const std::vector<std::shared_ptr<Expression<T>>>& roots) {
+    std::vector<const Expression<T>*> pointers;
+    for (const auto& root : roots)
+        pointers.push_back(root.get());
+    return expression_shape(pointers);
+}
+template <typename T>
+ExpressionShape Expression<T>::shape() const {
+    return expression_shape(std::vector<const Expression<T>*>{ this });
+}
+
+// Bump allocator for expression nodes. Allocation is a pointer increment into
+// the current block and individual deallocation is a no-op; all blocks are
+// released together once the arena handle and every node allocated from it
+// are gone. Copies of the handle share the same blocks. Allocation must stay
+// on one thread at a time, but handles and nodes may be released on any
+// thread: parsed and deserialized trees are handed to pool workers, so the
+// reference count is atomic. It counts handles and live allocations, not
+// allocator copies, so std::allocate_shared touches it once per node.
+class ExpressionArena {
+public:
+    explicit ExpressionArena(size_t block_size = 64 * 1024)
+        : state(new State{ {}, nullptr, nullptr, block_size, 1, 0, 0 }) {}
+    ExpressionArena(const ExpressionArena& other)
+        : state(other.state) {
+        acquire(state);
+    }
+    ExpressionArena& operator=(const ExpressionArena& other) {
+        acquire(other.state);
+        release(state);
+        state = other.state;
+        return *this;
+    }
+    ~ExpressionArena() {
+        release(state);
+    }
+    void* allocate(size_t bytes, size_t alignment) {
+        return allocate(state, bytes, alignment);
+    }
+    size_t allocations() const {
+        return state->allocations;
+    }
+    size_t bytes() const {
+        return state->bytes;
+    }
+    size_t blocks() const {
+        return state->blocks.size();
+    }
+    bool operator==(const ExpressionArena& other) const {
+        return state == other.state;
+    }
+private:
+    template <typename U> friend class ArenaAllocator;
+    struct State {
+        std::vector<std::unique_ptr<char[]>> blocks;
+        char* cursor;
+        char* end;
+        size_t block_size;
+        std::atomic<size_t> references;
+        size_t allocations;
+        size_t bytes;
+    };
+    State* state;
+
+    static void* allocate(State* state, size_t bytes, size_t alignment) {
+        size_t padding = (alignment - reinterpret_cast<std::uintptr_t>(state->cursor) % alignment) % alignment;
+        if (state->cursor == nullptr || padding + bytes > static_cast<size_t>(state->end - state->cursor)) {
+            size_t size = std::max(state->block_size, bytes + alignment);
+            state->blocks.emplace_back(new char[size]);
+            state->cursor = state->blocks.back().get();
+            state->end = state->cursor + size;
+            padding = (alignment - reinterpret_cast<std::uintptr_t>(state->cursor) % alignment) % alignment;
+        }
+        void* result = state->cursor + padding;
+        state->cursor += padding + bytes;
+        state->allocations++;
+        state->bytes += bytes;
+        return result;
+    }
+    static void acquire(State* state) {
+        state->references.fetch_add(1, std::memory_order_relaxed);
+    }
+    static void release(State* state) {
+        if (state->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete state;
+    }
+};
+
+// Standard allocator over an ExpressionArena, for std::allocate_shared. The
+// node and its control block land in a single arena allocation, which keeps
+// the arena alive until it is deallocated. The allocator itself does not, so
+// it must not outlive the handle it was made from unless it holds memory.
+template <typename U>
+class ArenaAllocator {
+public:
+    using value_type = U;
+
+    explicit ArenaAllocator(const ExpressionArena& arena)
+        : state(arena.state) {}
+    template <typename V>
+    ArenaAllocator(const ArenaAllocator<V>& other)
+        : state(other.state) {}
+    U* allocate(size_t n) {
+        ExpressionArena::acquire(state);
+        return static_cast<U*>(ExpressionArena::allocate(state, n * sizeof(U), alignof(U)));
+    }
+    void deallocate(U*, size_t) {
+        ExpressionArena::release(state);
+    }
+    template <typename V>
+    bool operator==(const ArenaAllocator<V>& other) const {
+        return state == other.state;
+    }
+    template <typename V>
+    bool operator!=(const ArenaAllocator<V>& other) const {
+        return state != other.state;
+    }
+private:
+    template <typename V> friend class ArenaAllocator;
+    ExpressionArena::State* state;
+};
+
+// Builds expression nodes. With hash-consing enabled, structurally identical
+// nodes are created once and shared, so a tree becomes a DAG whose size is
+// the number of distinct subexpressions. differentiate() and substitute()
+// results are memoized per node, which keeps their cost linear in the DAG
+// size instead of the (possibly exponential) size of the unfolded tree.
+// The factory keeps every node it interned alive until it is destroyed.
+// Given an arena, nodes are bump-allocated from it instead of the heap.
+template <typename T>
+class ExpressionFactory {
+public:
+    explicit ExpressionFactory(bool hash_consing = true)
+        : hash_consing(hash_consing) {}
+    ExpressionFactory(bool hash_consing, const ExpressionArena& arena)
+        : hash_consing(hash_consing),
+        arena(arena) {}
+
+    std::shared_ptr<Expression<T>> constant(T value) {
+        if (!hash_consing)
+            return make<ConstExpression<T>>(value);
+        Key key{ CONSTANT, 0, nullptr, nullptr, value };
+        return lookup(key, [&] { return make<ConstExpression<T>>(value); });
+    }
+    std::shared_ptr<Expression<T>> variable(const std::string& name) {
+        std::uint32_t symbol = SymbolTable::intern(name);
+        if (!hash_consing)
+            return make<VariableExpression<T>>(name, symbol);
+        Key key{ VARIABLE, symbol, nullptr, nullptr, T() };
+        return lookup(key, [&] { return make<VariableExpression<T>>(name, symbol); });
+    }
+    // Operands are taken by value so callers can move them into the node.
+    std::shared_ptr<Expression<T>> unary(typename UnaryOperationExpression<T>::Type type, std::shared_ptr<Expression<T>> operand) {
+        if (!hash_consing)
+            return make<UnaryOperationExpression<T>>(type, std::move(operand));
+        Key key{ UNARY, static_cast<std::uint32_t>(type), operand.get(), nullptr, T() };
+        return lookup(key, [&] { return make<UnaryOperationExpression<T>>(type, std::move(operand)); });
+    }
+    std::shared_ptr<Expression<T>> binary(typename BinaryOperationExpression<T>::Type type, std::shared_ptr<Expression<T>> left, std::shared_ptr<Expression<T>> right) {
+        if (!hash_consing)
+            return make<BinaryOperationExpression<T>>(type, std::move(left), std::move(right));
+        Key key{ BINARY, static_cast<std::uint32_t>(type), left.get(), right.get(), T() };
+        return lookup(key, [&] { return make<BinaryOperationExpression<T>>(type, std::move(left), std::move(right)); });
+    }
+    // Canonical node structurally equal to expr.
+    std::shared_ptr<Expression<T>> intern(const std::shared_ptr<Expression<T>>& expr) {
+        if (!hash_consing)
+            return expr;
+        auto it = interned.find(expr.get());
+        if (it != interned.end())
+            return it->second.second;
+        std::shared_ptr<Expression<T>> result;
+        memoize(expr, interned, [&](const std::shared_ptr<Expression<T>>& node) {
+            if (auto c = std::dynamic_pointer_cast<ConstExpression<T>>(node))
+                result = constant(c->value);
+            else if (auto v = std::dynamic_pointer_cast<VariableExpression<T>>(node))
+                result = variable(v->name);
+            else if (auto u = std::dynamic_pointer_cast<UnaryOperationExpression<T>>(node))
+                result = unary(u->type, intern(u->operand));
+            else if (auto b = std::dynamic_pointer_cast<BinaryOperationExpression<T>>(node))
+                result = binary(b->type, intern(b->operand_left), intern(b->operand_right));
+            else
+                throw std::runtime_error("Unknown expression type");
+            interned.emplace(node.get(), std::make_pair(node, result));
+        });
+        return result;
+    }
+    std::shared_ptr<Expression<T>> differentiate(const std::shared_ptr<Expression<T>>& expr, const std::string& variable, bool& contains_variable) {
+        return differentiate(expr, SymbolTable::intern(variable), contains_variable);
+    }
+    std::shared_ptr<Expression<T>> differentiate(const std::shared_ptr<Expression<T>>& expr, std::uint32_t variable, bool& contains_variable) {
+        auto& memo = derivatives[variable];
+        auto it = memo.find(expr.get());
+        if (it != memo.end()) {
+            contains_variable = it->second.contains_variable;
+            return it->second.result;
+        }
+        std::shared_ptr<Expression<T>> result;
+        memoize(expr, memo, [&](const std::shared_ptr<Expression<T>>& node) {
+            result = node->differentiate(variable, contains_variable, *this);
+            memo.emplace(node.get(), Derivative{ node, result, contains_variable });
+        });
+        return result;
+    }
+    // result[i][j] is d exprs[i] / d variables[j]. Inputs are interned first,
+    // so structurally equal subtrees share their derivatives across rows.
+    std::vector<std::vector<std::shared_ptr<Expression<T>>>> jacobian(const std::vector<std::shared_ptr<Expression<T>>>& exprs, const std::vector<std::string>& variables) {
+        std::vector<std::uint32_t> symbols;
+        for (const std::string& variable : variables)
+            symbols.push_back(SymbolTable::intern(variable));
+        std::vector<std::vector<std::shared_ptr<Expression<T>>>> result;
+        result.reserve(exprs.size());
+        for (const auto& expr : exprs) {
+            auto root = intern(expr);
+            std::vector<std::shared_ptr<Expression<T>>> row;
+            row.reserve(symbols.size());
+            bool contains_variable = false;
+            for (std::uint32_t symbol : symbols)
+                row.push_back(differentiate(root, symbol, contains_variable));
+            result.push_back(std::move(row));
+        }
+        return result;
+    }
+    // result[i][j] is d2 expr / d variables[i] d variables[j]. Each mixed
+    // partial is derived once and the same node fills both symmetric entries.
+    std::vector<std::vector<std::shared_ptr<Expression<T>>>> hessian(const std::shared_ptr<Expression<T>>& expr, const std::vector<std::string>& variables) {
+        auto gradient = jacobian({ expr }, variables)[0];
+        size_t n = variables.size();
+        std::vector<std::vector<std::shared_ptr<Expression<T>>>> result(n, std::vector<std::shared_ptr<Expression<T>>>(n));
+        bool contains_variable = false;
+        for (size_t i = 0; i < n; i++)
+            for (size_t j = i; j < n; j++)
+                result[i][j] = result[j][i] = differentiate(gradient[i], SymbolTable::intern(variables[j]), contains_variable);
+        return result;
+    }
+    std::shared_ptr<Expression<T>> substitute(const std::shared_ptr<Expression<T>>& expr, const std::string& variable, T val) {
+        return substitute(expr, SymbolTable::intern(variable), val);
+    }
+    std::shared_ptr<Expression<T>> substitute(const std::shared_ptr<Expression<T>>& expr, std::uint32_t variable, T val) {
+        if (substitutions.empty() || variable != substituted_variable || !same_value(val, substituted_value) || folding != substituted_folding) {
+            substitutions.clear();
+            substituted_variable = variable;
+            substituted_value = val;
+            substituted_folding = folding;
+        }
+        auto it = substitutions.find(expr.get());
+        if (it != substitutions.end())
+            return it->second.second;
+        std::shared_ptr<Expression<T>> result;
+        memoize(expr, substitutions, [&](const std::shared_ptr<Expression<T>>& node) {
+            result = node->substitute(variable, val, *this);
+            substitutions.emplace(node.get(), std::make_pair(node, result));
+        });
+        return result;
+    }
+    // Partial evaluation for substitute(): nodes whose operands are all
+    // constants become one constant with the value eval() would give them.
+    void fold_constants(bool enabled) {
+        folding = enabled;
+    }
+    bool folds_constants() const {
+        return folding;
+    }
+    std::shared_ptr<Expression<T>> simplify(const std::shared_ptr<Expression<T>>& expr) {
+        auto it = simplified.find(expr.get());
+        if (it != simplified.end())
+            return it->second.second;
+        std::shared_ptr<Expression<T>> result;
+        memoize(expr, simplified, [&](const std::shared_ptr<Expression<T>>& node) {
+            result = node->simplify(*this);
+            simplified.emplace(node.get(), std::make_pair(node, result));
+        });
+        return result;
+    }
+    // Number of distinct nodes created through this factory.
+    size_t size() const {
+        return nodes.size();
+    }
+private:
+    enum Kind { CONSTANT, VARIABLE, UNARY, BINARY };
+    struct Key {
+        Kind kind;
+        std::uint32_t type; // operation type, or the symbol of a variable
+        const Expression<T>* left;
+        const Expression<T>* right;
+        T value;
+        bool operator==(const Key& other) const {
+            return kind == other.kind && type == other.type && left == other.left && right == other.right
+                && same_value(value, other.value);
+        }
+    };
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            size_t h = std::hash<std::uint64_t>()((static_cast<std::uint64_t>(key.type) << 2) | key.kind);
+            h = combine(h, std::hash<const void*>()(key.left));
+            h = combine(h, std::hash<const void*>()(key.right));
+            return combine(h, hash_value(key.value));
+        }
+    };
+    struct Derivative {
+        std::shared_ptr<Expression<T>> expr; // keeps the key address alive
+        std::shared_ptr<Expression<T>> result;
+        bool contains_variable;
+    };
+    using Memo = std::unordered_map<const Expression<T>*, std::pair<std::shared_ptr<Expression<T>>, std::shared_ptr<Expression<T>>>>;
+
+    bool hash_consing;
+    std::optional<ExpressionArena> arena;
+    std::unordered_map<Key, std::shared_ptr<Expression<T>>, KeyHash> nodes;
+    Memo interned;
+    Memo simplified;
+    Memo substitutions;
+    std::uint32_t substituted_variable = 0;
+    T substituted_value = T();
+    bool substituted_folding = false;
+    bool folding = false;
+    static constexpr size_t max_recursion = 256;
+    size_t depth = 0; // nested memoize() calls
+    std::unordered_map<std::uint32_t, std::unordered_map<const Expression<T>*, Derivative>> derivatives;
+
+    template <typename Node, typename... Args>
+    std::shared_ptr<Expression<T>> make(Args&&... args) {
+        if (arena) {
+            Statistics::count(Statistics::ARENA_ALLOCATIONS);
+            return std::allocate_shared<Node>(ArenaAllocator<Node>(*arena), std::forward<Args>(args)...);
+        }
+        Statistics::count(Statistics::HEAP_ALLOCATIONS);
+        return std::make_shared<Node>(std::forward<Args>(args)...);
+    }
+    template <typename Make>
+    std::shared_ptr<Expression<T>> lookup(const Key& key, Make make) {
+        auto it = nodes.find(key);
+        if (it != nodes.end())
+            return it->second;
+        std::shared_ptr<Expression<T>> node = make();
+        nodes.emplace(key, node);
+        return node;
+    }
+    // Runs step on expr, which calls back into the factory for its operands.
+    // Up to max_recursion nested calls this recursion is the whole walk; past
+    // that, postorder() fills the memo bottom-up instead, so arbitrarily deep
+    // trees use bounded call stack. Either way the last step is for expr.
+    template <typename Memo, typename Step>
+    void memoize(const std::shared_ptr<Expression<T>>& expr, const Memo& memo, Step step) {
+        if (depth >= max_recursion) {
+            postorder(expr, memo, step);
+            return;
+        }
+        struct Nesting {
+            size_t& depth;
+            ~Nesting() {
+                depth--;
+            }
+        } nesting{ ++depth };
+        step(expr);
+    }
+    // Runs step on every operation node under expr that memo does not hold
+    // yet, operands first. A step finds the operand results it asks for
+    // already memoized, or computes them for a leaf, so the per-node virtual
+    // calls nest two levels deep at most instead of once per tree level.
+    template <typename Memo, typename Step>
+    static void postorder(const std::shared_ptr<Expression<T>>& expr, const Memo& memo, Step step) {
+        using U = UnaryOperationExpression<T>;
+        using B = BinaryOperationExpression<T>;
+        auto is_operation = [](const std::shared_ptr<Expression<T>>& node) {
+            return node->kind() == Expression<T>::UNARY || node->kind() == Expression<T>::BINARY;
+        };
+        if (!is_operation(expr)) {
+            step(expr);
+            return;
+        }
+        std::vector<std::pair<const std::shared_ptr<Expression<T>>*, bool>> stack{ { &expr, false } };
+        auto visit = [&](const std::shared_ptr<Expression<T>>& operand) {
+            if (is_operation(operand) && !memo.count(operand.get()))
+                stack.push_back({ &operand, false });
+        };
+        while (!stack.empty()) {
+            auto [node, expanded] = stack.back();
+            // A shared operand may have been finished since it was pushed;
+            // an expanded node cannot be, its operands do not reach it.
+            if (expanded || memo.count(node->get())) {
+                stack.pop_back();
+                if (expanded)
+                    step(*node);
+                continue;
+            }
+            stack.back().second = true;
+            if ((*node)->kind() == Expression<T>::UNARY)
+                visit(static_cast<const U*>(node->get())->operand);
+            else {
+                visit(static_cast<const B*>(node->get())->operand_right);
+                visit(static_cast<const B*>(node->get())->operand_left);
+            }
+        }
+    }
+    static size_t combine(size_t seed, size_t h) {
+        return seed ^ (h + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+    }
+    // Constants are compared bitwise so that 0 and -0 stay distinct.
+    static bool same_value(const T& a, const T& b) {
+        return std::memcmp(&a, &b, sizeof(T)) == 0;
+    }
+    static size_t hash_value(const T& value) {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&value);
+        size_t h = 14695981039346656037ull;
+        for (size_t i = 0; i < sizeof(T); i++)
+            h = (h ^ bytes[i]) * 1099511628211ull;
+        return h;
+    }
+};
+
+// Lane-wise kernels for CompiledExpression::eval_batch. A register holds a
+// block of lanes as contiguous planes of Scalar: one plane for real types,
+// split real and imaginary planes for std::complex. The arithmetic loops are
+// plain contiguous loops the compiler vectorizes; transcendentals call the
+// scalar library per lane so batch results match eval().
+template <typename T>
+struct BatchKernel {
+    using Scalar = T;
+    static constexpr size_t planes = 1;
+
+    static void load(const T* src, Scalar* dst, size_t n, size_t) {
+        std::copy(src, src + n, dst);
+    }
+    static void store(const Scalar* src, T* dst, size_t n, size_t) {
+        std::copy(src, src + n, dst);
+    }
+    static void broadcast(T value, Scalar* dst, size_t n, size_t) {
+        std::fill(dst, dst + n, value);
+    }
+    static void inv(Scalar* d, const Scalar* a, size_t n, size_t) {
+        for (size_t i = 0; i < n; i++) d[i] = -a[i];
+    }
+    template <typename F>
+    static void map(F f, Scalar* d, const Scalar* a, size_t n, size_t) {
+        for (size_t i = 0; i < n; i++) d[i] = f(a[i]);
+    }
+    static void add(Scalar* d, const Scalar* a, const Scalar* b, size_t n, size_t) {
+        for (size_t i = 0; i < n; i++) d[i] = a[i] + b[i];
+    }
+    static void sub(Scalar* d, const Scalar* a, const Scalar* b, size_t n, size_t) {
+        for (size_t i = 0; i < n; i++) d[i] = a[i] - b[i];
+    }
+    static void mul(Scalar* d, const Scalar* a, const Scalar* b, size_t n, size_t) {
+        for (size_t i = 0; i < n; i++) d[i] = a[i] * b[i];
+    }
+    static void div(Scalar* d, const Scalar* a, const Scalar* b, size_t n, size_t) {
+        for (size_t i = 0; i < n; i++) d[i] = a[i] / b[i];
+    }
+    template <typename F>
+    static void zip(F f, Scalar* d, const Scalar* a, const Scalar* b, size_t n, size_t) {
+        for (size_t i = 0; i < n; i++) d[i] = f(a[i], b[i]);
+    }
+};
+// The imaginary plane of a register starts `stride` scalars after the real one.
+template <typename Y>
+struct BatchKernel<std::complex<Y>> {
+    using Scalar = Y;
+    using T = std::complex<Y>;
+    static constexpr size_t planes = 2;
+
+    static void load(const T* src, Scalar* dst, size_t n, size_t stride) {
+        for (size_t i = 0; i < n; i++) {
+            dst[i] = src[i].real();
+            dst[stride + i] = src[i].imag();
+        }
+    }
+    static void store(const Scalar* src, T* dst, size_t n, size_t stride) {
+        for (size_t i = 0; i < n; i++)
+            dst[i] = T(src[i], src[stride + i]);
+    }
+    static void broadcast(T value, Scalar* dst, size_t n, size_t stride) {
+        std::fill(dst, dst + n, value.real());
+        std::fill(dst + stride, dst + stride + n, value.imag());
+    }
+    static void inv(Scalar* d, const Scalar* a, size_t n, size_t stride) {
+        for (size_t i = 0; i < n; i++) d[i] = -a[i];
+        for (size_t i = 0; i < n; i++) d[stride + i] = -a[stride + i];
+    }
+    template <typename F>
+    static void map(F f, Scalar* d, const Scalar* a, size_t n, size_t stride) {
+        for (size_t i = 0; i < n; i++) {
+            T v = f(T(a[i], a[stride + i]));
+            d[i] = v.real();
+            d[stride + i] = v.imag();
+        }
+    }
+    static void add(Scalar* d, const Scalar* a, const Scalar* b, size_t n, size_t stride) {
+        for (size_t i = 0; i < n; i++) d[i] = a[i] + b[i];
+        for (size_t i = 0; i < n; i++) d[stride + i] = a[stride + i] + b[stride + i];
+    }
+    static void sub(Scalar* d, const Scalar* a, const Scalar* b, size_t n, size_t stride) {
+        for (size_t i = 0; i < n; i++) d[i] = a[i] - b[i];
+        for (size_t i = 0; i < n; i++) d[stride + i] = a[stride + i] - b[stride + i];
+    }
+    static void mul(Scalar* d, const Scalar* a, const Scalar* b, size_t n, size_t stride) {
+        const Scalar* ai = a + stride;
+        const Scalar* bi = b + stride;
+        Scalar* di = d + stride;
+        for (size_t i = 0; i < n; i++) {
+            Scalar re = a[i] * b[i] - ai[i] * bi[i];
+            Scalar im = a[i] * bi[i] + ai[i] * b[i];
+            if (re != re && im != im) {
+                // Both parts NaN: defer to the library for the infinity recovery rules.
+                T v = T(a[i], ai[i]) * T(b[i], bi[i]);
+                re = v.real();
+                im = v.imag();
+            }
+            d[i] = re;
+            di[i] = im;
+        }
+    }
+    // Complex division keeps the library's scaled algorithm for accuracy.
+    static void div(Scalar* d, const Scalar* a, const Scalar* b, size_t n, size_t stride) {
+        zip([](const T& x, const T& y) { return x / y; }, d, a, b, n, stride);
+    }
+    template <typename F>
+    static void zip(F f, Scalar* d, const Scalar* a, const Scalar* b, size_t n, size_t stride) {
+        for (size_t i = 0; i < n; i++) {
+            T v = f(T(a[i], a[stride + i]), T(b[i], b[stride + i]));
+            d[i] = v.real();
+            d[stride + i] = v.imag();
+        }
+    }
+};
+
+// Flat postorder form of an expression tree. Every instruction reads its
+// operands from and writes its result to a register file laid out as
+// [constants | variable slots | temporaries], so leaves cost nothing at
+// evaluation time and variables are resolved to slots once.
+template <typename T>
+class CompiledExpression {
+public:
+    enum Opcode : std::uint8_t { INV, EXP, SIN, COS, LOG, ADD, SUB, MUL, DIV, POW };
+    struct Instruction {
+        Opcode op;
+        std::uint32_t dst, left, right; // register indices, right is unused by unary ops
+    };
+    std::vector<Instruction> code;
+    std::vector<T> constants;
+    std::vector<std::string> variables;
+    std::vector<std::uint32_t> symbols; // SymbolTable id of each variable slot
+    size_t temporaries = 0;
+    std::uint32_t result = 0;
+    // Where each instruction's operands come from when every instruction keeps
+    // its own value: registers below constants.size() + variables.size() are
+    // leaves, value constants.size() + variables.size() + i is instruction i.
+    struct Source {
+        std::uint32_t left, right;
+    };
+    std::vector<Source> sources;
+    std::uint32_t result_source = 0;
+
+    void emit_constant(T val) {
+        operands.push_back(ref(CONSTANT, constants.size()));
+        constants.push_back(val);
+    }
+    void emit_variable(const std::string& name, std::uint32_t symbol) {
+        operands.push_back(ref(VARIABLE, slot(name, symbol)));
+    }
+    void emit_unary(typename UnaryOperationExpression<T>::Type type) {
+        switch (type) {
+        case UnaryOperationExpression<T>::INV: emit(INV, 1); break;
+        case UnaryOperationExpression<T>::EXP: emit(EXP, 1); break;
+        case UnaryOperationExpression<T>::SIN: emit(SIN, 1); break;
+        case UnaryOperationExpression<T>::COS: emit(COS, 1); break;
+        case UnaryOperationExpression<T>::LOG: emit(LOG, 1); break;
+        default: throw std::runtime_error("Unknown unary operation");
+        }
+    }
+    void emit_binary(typename BinaryOperationExpression<T>::Type type) {
+        switch (type) {
+        case BinaryOperationExpression<T>::ADD: emit(ADD, 2); break;
+        case BinaryOperationExpression<T>::SUB: emit(SUB, 2); break;
+        case BinaryOperationExpression<T>::MUL: emit(MUL, 2); break;
+        case BinaryOperationExpression<T>::DIV: emit(DIV, 2); break;
+        case BinaryOperationExpression<T>::POW: emit(POW, 2); break;
+        default: throw std::runtime_error("Unknown binary operation");
+        }
+    }
+    // Resolves operand references to absolute registers once the number of
+    // constants and variables is known.
+    void finalize() {
+        if (operands.size() != 1)
+            throw std::runtime_error("Malformed expression");
+        for (Instruction& ins : code) {
+            ins.dst = resolve(ins.dst);
+            ins.left = resolve(ins.left);
+            ins.right = resolve(ins.right);
+        }
+        result = resolve(operands.back());
+        operands.clear();
+        std::uint32_t leaves = static_cast<std::uint32_t>(constants.size() + variables.size());
+        std::vector<std::uint32_t> writer(temporaries);
+        auto source = [&](std::uint32_t reg) { return reg < leaves ? reg : writer[reg - leaves]; };
+        sources.clear();
+        sources.reserve(code.size());
+        for (size_t i = 0; i < code.size(); i++) {
+            sources.push_back({ source(code[i].left), source(code[i].right) });
+            writer[code[i].dst - leaves] = leaves + static_cast<std::uint32_t>(i);
+        }
+        result_source = source(result);
+    }
+    // Slot of a variable, allocating a new one on first use.
+    size_t slot(const std::string& name, std::uint32_t symbol) {
+        if (symbol < slot_index.size() && slot_index[symbol] != no_slot)
+            return slot_index[symbol];
+        if (symbol >= slot_index.size())
+            slot_index.resize(symbol + 1, no_slot);
+        variables.push_back(name);
+        symbols.push_back(symbol);
+        return slot_index[symbol] = variables.size() - 1;
+    }
+    size_t slot(const std::string& name) {
+        return slot(name, SymbolTable::intern(name));
+    }
+    size_t registers() const {
+        return constants.size() + variables.size() + temporaries;
+    }
+
+    // slots[i] holds the value of variables[i].
+    T eval(const T* slots) const {
+        constexpr size_t inline_registers = 64;
+        T inline_buffer[inline_registers];
+        std::vector<T> heap_buffer;
+        T* r = inline_buffer;
+        if (registers() > inline_registers) {
+            heap_buffer.resize(registers());
+            r = heap_buffer.data();
+        }
+        std::copy(constants.begin(), constants.end(), r);
+        std::copy(slots, slots + variables.size(), r + constants.size());
+        for (const Instruction& ins : code) {
+            switch (ins.op) {
+            case INV: r[ins.dst] = -r[ins.left]; break;
+            case EXP: r[ins.dst] = Elementary<T>::exp(r[ins.left]); break;
+            case SIN: r[ins.dst] = Elementary<T>::sin(r[ins.left]); break;
+            case COS: r[ins.dst] = Elementary<T>::cos(r[ins.left]); break;
+            case LOG: r[ins.dst] = Elementary<T>::log(r[ins.left]); break;
+            case ADD: r[ins.dst] = r[ins.left] + r[ins.right]; break;
+            case SUB: r[ins.dst] = r[ins.left] - r[ins.right]; break;
+            case MUL: r[ins.dst] = r[ins.left] * r[ins.right]; break;
+            case DIV: r[ins.dst] = r[ins.left] / r[ins.right]; break;
+            case POW: r[ins.dst] = ins.right < constants.size() ? Elementary<T>::power(r[ins.left], r[ins.right]) : Elementary<T>::pow(r[ins.left], r[ins.right]); break;
+            }
+        }
+        return r[result];
+    }
+    T eval(const std::vector<T>& slots) const {
+        if (slots.size() < variables.size())
+            throw std::runtime_error("Not enough variable slots");
+        return eval(slots.data());
+    }
+    T eval(const std::unordered_map<std::string, T>& environment) const {
+        return eval(bind(environment));
+    }
+    // Evaluates `count` points at once. columns[i] points to `count` contiguous
+    // values of variables[i]; results are written to out[0..count).
+    void eval_batch(const T* const* columns, T* out, size_t count) const {
+        using Kernel = BatchKernel<T>;
+        run_batch([&](size_t slot, size_t begin, typename Kernel::Scalar* dst, size_t n) {
+            Kernel::load(columns[slot] + begin, dst, n, batch_block);
+        }, [&](const typename Kernel::Scalar* src, size_t begin, size_t n) {
+            Kernel::store(src, out + begin, n, batch_block);
+        }, count);
+    }
+    // Same as above with inputs and outputs already split into planes: for
+    // std::complex columns[2 * i] and columns[2 * i + 1] are the real and
+    // imaginary parts of variables[i], out[0] and out[1] receive the result.
+    void eval_batch_planes(const typename BatchKernel<T>::Scalar* const* columns, typename BatchKernel<T>::Scalar* const* out, size_t count) const {
+        using Kernel = BatchKernel<T>;
+        run_batch([&](size_t slot, size_t begin, typename Kernel::Scalar* dst, size_t n) {
+            for (size_t p = 0; p < Kernel::planes; p++)
+                std::copy(columns[slot * Kernel::planes + p] + begin, columns[slot * Kernel::planes + p] + begin + n, dst + p * batch_block);
+        }, [&](const typename Kernel::Scalar* src, size_t begin, size_t n) {
+            for (size_t p = 0; p < Kernel::planes; p++)
+                std::copy(src + p * batch_block, src + p * batch_block + n, out[p] + begin);
+        }, count);
+    }
+    std::vector<T> eval_batch(const std::unordered_map<std::string, std::vector<T>>& columns) const {
+        std::vector<const T*> pointers;
+        size_t count = 0;
+        for (size_t i = 0; i < variables.size(); i++) {
+            auto it = columns.find(variables[i]);
+            if (it == columns.end())
+                throw std::runtime_error("Unknown variable: " + variables[i]);
+            if (i == 0)
+                count = it->second.size();
+            else if (it->second.size() != count)
+                throw std::runtime_error("Columns have different lengths");
+            pointers.push_back(it->second.data());
+        }
+        if (variables.empty() && !columns.empty())
+            count = columns.begin()->second.size();
+        std::vector<T> out(count);
+        eval_batch(pointers.data(), out.data(), count);
+        return out;
+    }
+    // Reverse-mode differentiation: returns the value and writes d/d variables[i]
+    // to partials[i]. The derivative rules match Expression::differentiate.
+    T gradient(const T* slots, T* partials) const {
+        size_t leaves = constants.size() + variables.size();
+        std::vector<T> values(leaves + code.size());
+        std::copy(constants.begin(), constants.end(), values.begin());
+        std::copy(slots, slots + variables.size(), values.begin() + constants.size());
+        for (size_t i = 0; i < code.size(); i++) {
+            const T& l = values[sources[i].left];
+            const T& r = values[sources[i].right];
+            T& v = values[leaves + i];
+            switch (code[i].op) {
+            case INV: v = -l; break;
+            case EXP: v = Elementary<T>::exp(l); break;
+            case SIN: v = Elementary<T>::sin(l); break;
+            case COS: v = Elementary<T>::cos(l); break;
+            case LOG: v = Elementary<T>::log(l); break;
+            case ADD: v = l + r; break;
+            case SUB: v = l - r; break;
+            case MUL: v = l * r; break;
+            case DIV: v = l / r; break;
+            case POW: v = sources[i].right < constants.size() ? Elementary<T>::power(l, r) : Elementary<T>::pow(l, r); break;
+            }
+        }
+        std::vector<T> adjoints(values.size(), T(0));
+        adjoints[result_source] = T(1);
+        for (size_t i = code.size(); i-- > 0;) {
+            const T a = adjoints[leaves + i];
+            if (a == T(0))
+                continue;
+            const std::uint32_t li = sources[i].left, ri = sources[i].right;
+            const T& l = values[li];
+            const T& r = values[ri];
+            switch (code[i].op) {
+            case INV: adjoints[li] -= a; break;
+            case EXP: adjoints[li] += a * values[leaves + i]; break;
+            case SIN: adjoints[li] += a * Elementary<T>::cos(l); break;
+            case COS: adjoints[li] -= a * Elementary<T>::sin(l); break;
+            case LOG: adjoints[li] += a * (T(1) / l); break;
+            case ADD: adjoints[li] += a; adjoints[ri] += a; break;
+            case SUB: adjoints[li] += a; adjoints[ri] -= a; break;
+            case MUL: adjoints[li] += a * r; adjoints[ri] += a * l; break;
+            case DIV: adjoints[li] += a / r; adjoints[ri] -= a * l / (r * r); break;
+            case POW:
+                // A constant exponent has no adjoint to receive.
+                if (ri < constants.size())
+                    adjoints[li] += a * (r * Elementary<T>::power(l, r - T(1)));
+                else {
+                    adjoints[li] += a * (r * Elementary<T>::pow(l, r - T(1)));
+                    adjoints[ri] += a * (values[leaves + i] * Elementary<T>::log(l));
+                }
+                break;
+            }
+        }
+        std::copy(adjoints.begin() + constants.size(), adjoints.begin() + leaves, partials);
+        return values[result_source];
+    }
+    // Partials are reported for every variable of the tape.
+    T gradient(const std::unordered_map<std::string, T>& environment, std::unordered_map<std::string, T>& partials) const {
+        std::vector<T> slots = bind(environment);
+        std::vector<T> derivatives(variables.size());
+        T value = gradient(slots.data(), derivatives.data());
+        for (size_t i = 0; i < variables.size(); i++)
+            partials[variables[i]] = derivatives[i];
+        return value;
+    }
+    // Resolves the named environment into slot order.
+    std::vector<T> bind(const std::unordered_map<std::string, T>& environment) const {
+        std::vector<T> slots;
+        slots.reserve(variables.size());
+        for (const std::string& name : variables) {
+            auto it = environment.find(name);
+            if (it == environment.end())
+                throw std::runtime_error("Unknown variable: " + name);
+            slots.push_back(it->second);
+        }
+        return slots;
+    }
+    std::vector<T> bind(const Environment<T>& environment) const {
+        std::vector<T> slots;
+        slots.reserve(symbols.size());
+        for (std::uint32_t symbol : symbols)
+            slots.push_back(environment.get(symbol));
+        return slots;
+    }
+    T eval(const Environment<T>& environment) const {
+        return eval(bind(environment));
+    }
+private:
+    static constexpr size_t batch_block = 256;
+
+    // Runs the tape over blocks of lanes. load(slot, begin, dst, n) fills the
+    // planes of a variable register, store(src, begin, n) drains the result.
+    template <typename Load, typename Store>
+    void run_batch(Load load, Store store, size_t count) const {
+        using Kernel = BatchKernel<T>;
+        using Scalar = typename Kernel::Scalar;
+        constexpr size_t B = batch_block;
+        std::vector<Scalar> scratch(registers() * Kernel::planes * B);
+        auto reg = [&](std::uint32_t index) { return scratch.data() + index * Kernel::planes * B; };
+        for (size_t c = 0; c < constants.size(); c++)
+            Kernel::broadcast(constants[c], reg(c), B, B);
+        for (size_t begin = 0; begin < count; begin += B) {
+            size_t n = std::min(B, count - begin);
+            for (size_t v = 0; v < variables.size(); v++)
+                load(v, begin, reg(constants.size() + v), n);
+            for (const Instruction& ins : code) {
+                Scalar* d = reg(ins.dst);
+                const Scalar* a = reg(ins.left);
+                const Scalar* b = reg(ins.right);
+                switch (ins.op) {
+                case INV: Kernel::inv(d, a, n, B); break;
+                case EXP: Kernel::map([](const T& x) { return Elementary<T>::exp(x); }, d, a, n, B); break;
+                case SIN: Kernel::map([](const T& x) { return Elementary<T>::sin(x); }, d, a, n, B); break;
+                case COS: Kernel::map([](const T& x) { return Elementary<T>::cos(x); }, d, a, n, B); break;
+                case LOG: Kernel::map([](const T& x) { return Elementary<T>::log(x); }, d, a, n, B); break;
+                case ADD: Kernel::add(d, a, b, n, B); break;
+                case SUB: Kernel::sub(d, a, b, n, B); break;
+                case MUL: Kernel::mul(d, a, b, n, B); break;
+                case DIV: Kernel::div(d, a, b, n, B); break;
+                case POW:
+                    if (ins.right < constants.size())
+                        Kernel::zip([](const T& x, const T& y) { return Elementary<T>::power(x, y); }, d, a, b, n, B);
+                    else
+                        Kernel::zip([](const T& x, const T& y) { return Elementary<T>::pow(x, y); }, d, a, b, n, B);
+                    break;
+                }
+            }
+            store(reg(result), begin, n);
+        }
+    }
+    // While compiling, operands are tagged references that finalize() resolves.
+    enum RefKind : std::uint32_t { CONSTANT, VARIABLE, TEMPORARY };
+    static constexpr std::uint32_t kind_shift = 30;
+    static constexpr std::uint32_t index_mask = (1u << kind_shift) - 1;
+    std::vector<std::uint32_t> operands;
+    static constexpr size_t no_slot = static_cast<size_t>(-1);
+    std::vector<size_t> slot_index; // by symbol id
+    size_t live_temporaries = 0;
+
+    static std::uint32_t ref(RefKind kind, size_t index) {
+        if (index > index_mask)
+            throw std::runtime_error("Expression is too large to compile");
+        return (static_cast<std::uint32_t>(kind) << kind_shift) | static_cast<std::uint32_t>(index);
+    }
+    std::uint32_t resolve(std::uint32_t reference) const {
+        std::uint32_t index = reference & index_mask;
+        switch (reference >> kind_shift) {
+        case CONSTANT: return index;
+        case VARIABLE: return static_cast<std::uint32_t>(constants.size()) + index;
+        default: return static_cast<std::uint32_t>(constants.size() + variables.size()) + index;
+        }
+    }
+    std::uint32_t pop() {
+        std::uint32_t reference = operands.back();
+        operands.pop_back();
+        if ((reference >> kind_shift) == TEMPORARY)
+            live_temporaries--;
+        return reference;
+    }
+    // Temporaries are freed in stack order, so the result can reuse the lowest free one.
+    void emit(Opcode op, int arity) {
+        if (operands.size() < static_cast<size_t>(arity))
+            throw std::runtime_error("Malformed expression");
+        std::uint32_t right = arity == 2 ? pop() : 0;
+        std::uint32_t left = pop();
+        std::uint32_t dst = ref(TEMPORARY, live_temporaries++);
+        if (live_temporaries > temporaries)
+            temporaries = live_temporaries;
+        code.push_back({ op, dst, left, arity == 2 ? right : left });
+        operands.push_back(dst);
+    }
+};
+
+#endif
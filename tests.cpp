@@ -5,6 +5,12 @@
 #include <unordered_map>
 #include <complex>
 #include "symbolic.hpp"
+#include "parallel.hpp"
+#include "jit.hpp"
+#include "parser.hpp"
+#include "serialize.hpp"
+#include "static_expression.hpp"
+#include "incremental.hpp"
 
 int main()
 {
@@ -61,5 +67,498 @@ int main()
         std::cout << "Test PASSED\n";
     else 
         std::cout << "Test FAILED\n";
+
+    std::cout << "Testing compilation...\n";
+    auto compiled = op.compile();
+    std::cout << "instructions: " << compiled.code.size() << ", registers: " << compiled.registers() << '\n';
+    bool compiled_ok = compiled.eval(env) == op.eval(env);
+    for (double x : { 0.5, 2.0, 3.7 }) {
+        env["x"] = x;
+        compiled_ok = compiled_ok && compiled.eval(env) == op.eval(env);
+    }
+    auto op2_compiled = op2.compile();
+    env["y"] = 5;
+    compiled_ok = compiled_ok && op2_compiled.eval(env) == op2.eval(env);
+    auto z = VariableExpression<std::complex<double>>("z");
+    auto complex_op = (Expression<std::complex<double>>::sin(z) ^ ConstExpression<std::complex<double>>(std::complex<double>(1, 2))) * z / (z - Expression<std::complex<double>>::cos(z));
+    std::unordered_map<std::string, std::complex<double>> complex_env; complex_env["z"] = std::complex<double>(0.3, -1.1);
+    compiled_ok = compiled_ok && complex_op.compile().eval(complex_env) == complex_op.eval(complex_env);
+    if (compiled_ok)
+        std::cout << "Test PASSED\n";
+    else
+        std::cout << "Test FAILED\n";
+
+    std::cout << "Testing batch evaluation...\n";
+    std::unordered_map<std::string, std::vector<double>> columns;
+    std::unordered_map<std::string, std::vector<std::complex<double>>> complex_columns;
+    for (int i = 0; i < 1000; i++) {
+        columns["x"].push_back(0.01 * i + 0.5);
+        columns["y"].push_back(1.0 - 0.003 * i);
+        complex_columns["z"].push_back(std::complex<double>(0.002 * i - 1, 0.5 - 0.001 * i));
+    }
+    auto batch = op2_compiled.eval_batch(columns);
+    auto complex_batch = complex_op.compile().eval_batch(complex_columns);
+    bool batch_ok = batch.size() == 1000 && complex_batch.size() == 1000;
+    for (int i = 0; batch_ok && i < 1000; i++) {
+        env["x"] = columns["x"][i];
+        env["y"] = columns["y"][i];
+        complex_env["z"] = complex_columns["z"][i];
+        batch_ok = batch[i] == op2.eval(env) && complex_batch[i] == complex_op.eval(complex_env);
+    }
+    if (batch_ok)
+        std::cout << "Test PASSED\n";
+    else
+        std::cout << "Test FAILED\n";
+
+    std::cout << "Testing hash-consed construction...\n";
+    ExpressionFactory<double> factory;
+    auto fx = factory.variable("x");
+    bool consing_ok = factory.binary(BinaryOperationExpression<double>::ADD, fx, factory.constant(2))
+        == factory.binary(BinaryOperationExpression<double>::ADD, factory.variable("x"), factory.constant(2));
+    auto interned = factory.intern(std::make_shared<BinaryOperationExpression<double>>(op));
+    consing_ok = consing_ok && interned == factory.intern(std::make_shared<BinaryOperationExpression<double>>(op)) && interned->eval(env) == op.eval(env);
+    // x ^ (x / (x ^ (x / ...))) doubles its unfolded derivative at every level.
+    std::shared_ptr<Expression<double>> nested = fx;
+    for (int i = 0; i < 40; i++)
+        nested = factory.binary(BinaryOperationExpression<double>::POW, fx, factory.binary(BinaryOperationExpression<double>::DIV, fx, nested));
+    bool cv = false;
+    size_t before = factory.size();
+    auto nested_diff = factory.differentiate(nested, "x", cv);
+    auto nested_diff2 = factory.differentiate(nested_diff, "x", cv);
+    std::cout << "distinct nodes: " << before << " -> " << factory.size() << '\n';
+    consing_ok = consing_ok && factory.size() < 100 * before;
+    auto shallow = fx;
+    for (int i = 0; i < 3; i++)
+        shallow = factory.binary(BinaryOperationExpression<double>::POW, fx, factory.binary(BinaryOperationExpression<double>::DIV, fx, shallow));
+    env["x"] = 1.3;
+    consing_ok = consing_ok && factory.differentiate(shallow, "x", cv)->eval(env) == shallow->differentiate("x")->eval(env);
+    if (consing_ok)
+        std::cout << "Test PASSED\n";
+    else
+        std::cout << "Test FAILED\n";
+
+    std::cout << "Testing simplification...\n";
+    auto x = VariableExpression<double>("x");
+    auto square = x ^ ConstExpression<double>(2);
+    std::cout << square.differentiate("x")->to_string() << " -> " << square.differentiate("x")->simplify()->to_string() << '\n';
+    bool simplify_ok = square.differentiate("x")->simplify()->to_string() == "(2 * x)";
+    simplify_ok = simplify_ok && ((x * ConstExpression<double>(0)) + (ConstExpression<double>(1) * x) - ConstExpression<double>(0)).simplify()->to_string() == "x";
+    simplify_ok = simplify_ok && (x + x + ConstExpression<double>(3) * x).simplify()->to_string() == "(5 * x)";
+    simplify_ok = simplify_ok && ((x ^ ConstExpression<double>(3)) * (x ^ ConstExpression<double>(2)) / x).simplify()->to_string() == "(x ^ 4)";
+    simplify_ok = simplify_ok && (ConstExpression<double>(2) * ConstExpression<double>(3) + Expression<double>::sin(ConstExpression<double>(0))).simplify()->to_string() == "6";
+    auto product = (x * x).simplify();
+    std::unordered_map<std::string, double> negative_x{ { "x", -2.0 } };
+    simplify_ok = simplify_ok && product->to_string() == "(x * x)" && product->differentiate("x")->eval(negative_x) == -4.0;
+    auto op_diff = op.differentiate("x");
+    auto op_simplified = op_diff->simplify();
+    std::cout << op_simplified->to_string() << '\n';
+    for (double xv : { 0.5, 1.0, 2.5 }) {
+        env["x"] = xv;
+        simplify_ok = simplify_ok && std::abs(op_simplified->eval(env) - op_diff->eval(env)) <= 1e-9 * (1 + std::abs(op_diff->eval(env)));
+    }
+    simplify_ok = simplify_ok && op_simplified->to_string().size() < op_diff->to_string().size();
+    factory.simplify(nested_diff2);
+    if (simplify_ok)
+        std::cout << "Test PASSED\n";
+    else
+        std::cout << "Test FAILED\n";
+
+    std::cout << "Testing reverse-mode gradient...\n";
+    auto op3 = op2 * (VariableExpression<double>("y") ^ x) / (x - VariableExpression<double>("y"));
+    env["x"] = 1.7; env["y"] = 0.4;
+    std::unordered_map<std::string, double> partials;
+    double value = op3.gradient(env, partials);
+    bool gradient_ok = value == op3.eval(env) && partials.size() == 2;
+    for (const char* name : { "x", "y" }) {
+        double expected = op3.differentiate(name)->eval(env);
+        std::cout << "d/d" << name << ": " << partials[name] << " (symbolic " << expected << ")\n";
+        gradient_ok = gradient_ok && std::abs(partials[name] - expected) <= 1e-9 * (1 + std::abs(expected));
+    }
+    std::unordered_map<std::string, std::complex<double>> complex_partials;
+    complex_op.gradient(complex_env, complex_partials);
+    std::complex<double> complex_expected = complex_op.differentiate("z")->eval(complex_env);
+    gradient_ok = gradient_ok && std::abs(complex_partials["z"] - complex_expected) <= 1e-9 * (1 + std::abs(complex_expected));
+    if (gradient_ok)
+        std::cout << "Test PASSED\n";
+    else
+        std::cout << "Test FAILED\n";
+
+    std::cout << "Testing arena allocation...\n";
+    ExpressionArena arena;
+    bool arena_ok = true;
+    {
+        ExpressionFactory<double> arena_factory(false, arena);
+        std::shared_ptr<Expression<double>> sum = arena_factory.variable("x");
+        for (int i = 1; i < 1000; i++)
+            sum = arena_factory.binary(BinaryOperationExpression<double>::ADD, sum, arena_factory.constant(i));
+        env["x"] = 1;
+        std::cout << "allocations: " << arena.allocations() << ", blocks: " << arena.blocks() << '\n';
+        arena_ok = arena.allocations() == 1999 && sum->eval(env) == 499501;
+    }
+    auto chain = (x + VariableExpression<double>("y")) * Expression<double>::sin(x - ConstExpression<double>(1)) + -(x / x);
+    arena_ok = arena_ok && chain.to_string() == "(((x + y) * sin((x - 1))) + (-(x / x)))";
+    if (arena_ok)
+        std::cout << "Test PASSED\n";
+    else
+        std::cout << "Test FAILED\n";
+
+    std::cout << "Testing slot-indexed environments...\n";
+    Environment<double> slots;
+    slots.set("x", 1.7);
+    slots.set(SymbolTable::intern("y"), 0.4);
+    env["x"] = 1.7; env["y"] = 0.4;
+    bool symbols_ok = SymbolTable::intern("x") == VariableExpression<double>("x").symbol && SymbolTable::name(SymbolTable::intern("y")) == "y";
+    symbols_ok = symbols_ok && op3.eval(slots) == op3.eval(env) && op3.compile().eval(slots) == op3.eval(env);
+    size_t symbol_count = SymbolTable::size();
+    Environment<double> unused({ { "x", 1.7 }, { "never_used_in_any_expression", 2.0 } });
+    symbols_ok = symbols_ok && SymbolTable::size() == symbol_count && !SymbolTable::find("never_used_in_any_expression")
+        && unused.contains(SymbolTable::intern("x")) && unused.get(SymbolTable::intern("x")) == 1.7;
+    try {
+        op3.eval(Environment<double>());
+        symbols_ok = false;
+    }
+    catch (const std::runtime_error& e) {
+        std::cout << e.what() << '\n';
+    }
+    if (symbols_ok)
+        std::cout << "Test PASSED\n";
+    else
+        std::cout << "Test FAILED\n";
+
+    std::cout << "Testing parallel evaluation...\n";
+    ThreadPool pool(4);
+    std::vector<const double*> column_data;
+    for (const std::string& name : op2_compiled.variables)
+        column_data.push_back(columns[name].data());
+    std::vector<double> parallel_batch(1000);
+    parallel_eval_batch(pool, op2_compiled, column_data.data(), parallel_batch.data(), 1000, 64);
+    auto derivatives = parallel_differentiate(pool, op3, { "x", "y" });
+    std::vector<std::shared_ptr<Expression<double>>> rows = { op2.share(), op3.share() };
+    auto jacobian = parallel_jacobian(pool, rows, { "x", "y" });
+    bool parallel_ok = parallel_batch == batch && derivatives.size() == 2 && jacobian.size() == 2;
+    for (size_t i = 0; parallel_ok && i < 2; i++) {
+        std::string name = i == 0 ? "x" : "y";
+        parallel_ok = derivatives[i]->to_string() == op3.differentiate(name)->to_string()
+            && jacobian[0][i]->to_string() == op2.differentiate(name)->to_string()
+            && jacobian[1][i]->to_string() == derivatives[i]->to_string();
+    }
+    // Trees from one arena handed to workers, which drop the last references.
+    std::vector<std::shared_ptr<Expression<double>>> arena_trees(256);
+    {
+        ExpressionFactory<double> arena_factory(false, ExpressionArena(1024));
+        for (size_t i = 0; i < arena_trees.size(); i++)
+            arena_trees[i] = arena_factory.binary(BinaryOperationExpression<double>::ADD,
+                arena_factory.binary(BinaryOperationExpression<double>::MUL, arena_factory.variable("x"), arena_factory.variable("y")),
+                arena_factory.constant(static_cast<double>(i)));
+    }
+    std::unordered_map<std::string, double> integer_env{ { "x", 2 }, { "y", 3 } };
+    std::atomic<size_t> arena_sum{ 0 };
+    parallel_for(pool, 0, arena_trees.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            arena_sum += static_cast<size_t>(arena_trees[i]->eval(integer_env));
+            arena_trees[i].reset();
+        }
+    });
+    parallel_ok = parallel_ok && arena_sum == 256 * 255 / 2 + 256 * 6;
+    if (parallel_ok)
+        std::cout << "Test PASSED\n";
+    else
+        std::cout << "Test FAILED\n";
+
+    std::cout << "Testing native compilation...\n";
+    std::string jit_cache = (std::filesystem::temp_directory_path() / ("symbolic-jit-tests-" + std::to_string(getpid()))).string();
+    bool jit_ok = true;
+    auto same = [](double a, double b) { return a == b || (std::isnan(a) && std::isnan(b)); };
+    try {
+        JitCompiler<double> jit(jit_cache);
+        JitCompiler<std::complex<double>> complex_jit(jit_cache);
+        auto native = jit.compile(op3);
+        auto complex_native = complex_jit.compile(complex_op);
+        std::vector<double> native_batch(1000);
+        jit.compile(op2_compiled).eval_batch(column_data.data(), native_batch.data(), 1000);
+        jit_ok = native_batch == batch;
+        for (int i = 0; jit_ok && i < 1000; i++) {
+            env["x"] = columns["x"][i];
+            env["y"] = columns["y"][i];
+            complex_env["z"] = complex_columns["z"][i];
+            jit_ok = same(native(env), op3.eval(env)) && complex_native(complex_env) == complex_op.eval(complex_env);
+        }
+        JitCompiler<double> restarted(jit_cache);
+        jit_ok = jit_ok && same(restarted.compile(op3)(env), op3.eval(env)) && restarted.builds() == 0 && restarted.hits() == 1;
+        JitCompiler<double> other_flags(jit_cache, JitCompiler<double>::default_compiler() + " -O1");
+        jit_ok = jit_ok && same(other_flags.compile(op3)(env), op3.eval(env)) && other_flags.builds() == 1 && other_flags.hits() == 0;
+    }
+    catch (const std::runtime_error& e) {
+        std::cout << e.what() << '\n';
+        jit_ok = false;
+    }
+    std::filesystem::remove_all(jit_cache);
+    if (jit_ok)
+        std::cout << "Test PASSED\n";
+    else
+        std::cout << "Test FAILED\n";
+
+    std::cout << "Testing infix and postfix parsing...\n";
+    Parser<std::complex<double>> postfix;
+    Parser<std::complex<double>> infix(Notation::INFIX);
+    std::unordered_map<std::string, std::complex<double>> parse_env;
+    parse_env["x"] = std::complex<double>(0.7, 0.2);
+    bool parse_ok = postfix.parse("x y * sin x 2 ^ y / +")->to_string() == infix.parse("sin(x*y) + x^2/y")->to_string()
+        && postfix.nodes() == 10 && infix.nodes() == 10 && infix.bytes() == 16
+        && infix.parse("-x^2")->to_string() == "(-(x ^ (2,0)))"
+        && infix.parse("2^3^2")->to_string() == "((2,0) ^ ((3,0) ^ (2,0)))"
+        && infix.parse("sin x^2 - -x")->to_string() == "((sin(x) ^ (2,0)) - (-x))"
+        && postfix.parse("x 1.5e-3-2e+1i *")->eval(parse_env) == parse_env["x"] * std::complex<double>(1.5e-3, -20)
+        && infix.parse("(1 - 2i) * x")->eval(parse_env) == (std::complex<double>(1, 0) - std::complex<double>(0, 2)) * parse_env["x"];
+    for (const char* broken : { "(x", "x)", "x y", "2 + * 3", "x $ 2", "sin" }) {
+        try {
+            infix.parse(broken);
+            parse_ok = false;
+        }
+        catch (const std::runtime_error&) {}
+    }
+    if (parse_ok)
+        std::cout << "Test PASSED\n";
+    else
+        std::cout << "Test FAILED\n";
+
+    std::cout << "Testing streaming printer and binary serialization...\n";
+    auto saved_diff = op3.differentiate("x");
+    std::ostringstream printed;
+    printed << *saved_diff;
+    auto shared_term = Expression<double>::sin(x * VariableExpression<double>("y")).share();
+    auto shared_sum = std::make_shared<BinaryOperationExpression<double>>(BinaryOperationExpression<double>::ADD, shared_term, shared_term);
+    auto unshared_sum = std::make_shared<BinaryOperationExpression<double>>(BinaryOperationExpression<double>::ADD, shared_term, shared_term->clone());
+    std::string stored = serialize<double>({ saved_diff, op2.share() });
+    auto loaded = deserialize<double>(stored);
+    env["x"] = 1.7; env["y"] = 0.4;
+    bool serial_ok = printed.str() == saved_diff->to_string() && loaded.size() == 2
+        && loaded[0]->to_string() == saved_diff->to_string() && loaded[1]->to_string() == op2.to_string()
+        && loaded[0]->eval(env) == saved_diff->eval(env)
+        && serialize(*shared_sum).size() < serialize(*unshared_sum).size()
+        && deserialize<double>(serialize(*shared_sum))[0]->to_string() == shared_sum->to_string();
+    for (std::string broken : { std::string(), stored.substr(0, stored.size() - 1), std::string(stored).replace(0, 4, "XXXX") }) {
+        try {
+            deserialize<double>(broken);
+            serial_ok = false;
+        }
+        catch (const std::runtime_error&) {}
+    }
+    try {
+        deserialize<std::complex<double>>(stored);
+        serial_ok = false;
+    }
+    catch (const std::runtime_error&) {}
+    if (serial_ok)
+        std::cout << "Test PASSED\n";
+    else
+        std::cout << "Test FAILED\n";
+
+    std::cout << "Testing Jacobian and Hessian generation...\n";
+    std::vector<std::string> xy = { "x", "y" };
+    auto row = op3.jacobian(xy);
+    auto hessian = op3.hessian(xy);
+    bool hessian_ok = row.size() == 2 && hessian.size() == 2 && hessian[0][1] == hessian[1][0];
+    for (size_t i = 0; hessian_ok && i < 2; i++) {
+        hessian_ok = row[i]->to_string() == op3.differentiate(xy[i])->to_string();
+        for (size_t j = i; hessian_ok && j < 2; j++)
+            hessian_ok = hessian[i][j]->to_string() == op3.differentiate(xy[i])->differentiate(xy[j])->to_string();
+    }
+    if (hessian_ok)
+        std::cout << "Test PASSED\n";
+    else
+        std::cout << "Test FAILED\n";
+
+    std::cout << "Testing compile-time expression templates...\n";
+    constexpr auto sx = static_expression::var<0>;
+    constexpr auto sy = static_expression::var<1>;
+    constexpr auto quadratic = sx * sx + 3.0 * sy;
+    static_assert(quadratic(2.0, 1.0) == 7.0, "constexpr evaluation");
+    static_assert(static_expression::diff(quadratic, sx)(2.0, 1.0) == 4.0, "compile-time derivative");
+    static_assert(std::is_same_v<decltype(static_expression::diff(3.0 * sy, sx)), static_expression::Zero>, "zero derivative folds away");
+    auto trig = sin(sx * sy) + (sx ^ 2.0) / sy - ln(exp(sx)) * cos(-sy);
+    auto trig_dynamic = static_expression::to_dynamic<double>(trig, { "x", "y" });
+    double static_slots[] = { 0.7, 1.3 };
+    env["x"] = 0.7; env["y"] = 1.3;
+    bool static_ok = trig_dynamic->to_string() == "((sin((x * y)) + ((x ^ 2) / y)) - (log(exp(x)) * cos((-y))))"
+        && trig.eval(static_slots) == trig_dynamic->eval(env);
+    for (size_t i = 0; static_ok && i < 2; i++) {
+        double expected = trig_dynamic->differentiate(i == 0 ? "x" : "y")->eval(env);
+        double actual = i == 0 ? static_expression::diff(trig, sx).eval(static_slots) : static_expression::diff(trig, sy).eval(static_slots);
+        static_ok = std::abs(actual - expected) <= 1e-12 * std::abs(expected);
+    }
+    std::complex<double> complex_slots[] = { { 0.7, 0.1 }, { 1.3, -0.2 } };
+    complex_env["x"] = complex_slots[0]; complex_env["y"] = complex_slots[1];
+    static_ok = static_ok && trig.eval(complex_slots) == static_expression::to_dynamic<std::complex<double>>(trig, { "x", "y" })->eval(complex_env);
+    // Static derivatives are the simplified dynamic ones: no NaN log term for a negative base.
+    auto cube = sx ^ 3.0;
+    auto cube_dynamic = static_expression::to_dynamic<double>(cube, { "x" });
+    std::unordered_map<std::string, double> negative_base{ { "x", -2.0 } };
+    static_ok = static_ok && static_expression::diff(cube, sx)(-2.0) == 12.0
+        && std::isnan(cube_dynamic->differentiate("x")->eval(negative_base))
+        && cube_dynamic->differentiate("x")->simplify()->eval(negative_base) == 12.0
+        && static_expression::to_dynamic<double>(static_expression::diff(cube, sx), { "x" })->to_string() == cube_dynamic->differentiate("x")->simplify()->to_string();
+    if (static_ok)
+        std::cout << "Test PASSED\n";
+    else
+        std::cout << "Test FAILED\n";
+
+    std::cout << "Testing instrumentation...\n";
+    auto shared_x = std::make_shared<VariableExpression<double>>("x");
+    auto shared_square = std::make_shared<BinaryOperationExpression<double>>(BinaryOperationExpression<double>::MUL, shared_x, shared_x);
+    auto doubled = std::make_shared<BinaryOperationExpression<double>>(BinaryOperationExpression<double>::ADD, shared_square, shared_square);
+    ExpressionShape doubled_shape = doubled->shape();
+    bool stats_ok = doubled_shape.size == 7 && doubled_shape.distinct == 3 && doubled_shape.depth == 3;
+    Statistics::reset();
+    {
+        Statistics::Phase phase("test");
+        ExpressionFactory<double> stats_factory(false);
+        stats_factory.binary(BinaryOperationExpression<double>::ADD, stats_factory.constant(1), stats_factory.variable("x"));
+        doubled->clone();
+    }
+    std::vector<Statistics::PhaseTotal> phases = Statistics::phases();
+    if (Statistics::enabled)
+        stats_ok = stats_ok && Statistics::get(Statistics::CONSTANT_NODES) == 1 && Statistics::get(Statistics::VARIABLE_NODES) == 1
+            && Statistics::get(Statistics::BINARY_NODES) == 2 && Statistics::get(Statistics::CLONES) == 1
+            && Statistics::get(Statistics::HEAP_ALLOCATIONS) == 4 && phases.size() == 1 && phases[0].calls == 1;
+    else
+        stats_ok = stats_ok && Statistics::get(Statistics::BINARY_NODES) == 0 && phases.empty();
+    if (stats_ok)
+        std::cout << "Test PASSED\n";
+    else
+        std::cout << "Test FAILED\n";
+
+    std::cout << "Testing incremental evaluation and constant-folding substitution...\n";
+    auto incremental_expr = op3 + Expression<double>::sin(VariableExpression<double>("z") * ConstExpression<double>(2));
+    IncrementalEvaluator<double> incremental(incremental_expr);
+    env["x"] = 1.7; env["y"] = 0.4; env["z"] = 0.9;
+    incremental.set(Environment<double>(env));
+    bool incremental_ok = incremental.eval() == incremental_expr.eval(env);
+    env["z"] = -0.3;
+    incremental.set("z", -0.3);
+    incremental_ok = incremental_ok && incremental.eval() == incremental_expr.eval(env) && incremental.recomputed() == 3;
+    env["x"] = 2.1; env["y"] = 0.7;
+    incremental.set("x", 2.1);
+    incremental.set("y", 0.7);
+    incremental_ok = incremental_ok && incremental.eval() == incremental_expr.eval(env) && incremental.recomputed() < incremental.size();
+    incremental.set("y", 0.7);
+    incremental_ok = incremental_ok && incremental.eval() == incremental_expr.eval(env) && incremental.recomputed() == 0;
+    auto partial = op3.substitute("y", 0.4, true);
+    auto folded = partial->substitute("x", 1.7, true);
+    env["x"] = 1.7; env["y"] = 0.4;
+    incremental_ok = incremental_ok && partial->to_string() == op3.substitute("y", 0.4)->to_string()
+        && ConstExpression<double>::match(folded) && folded->eval(env) == op3.eval(env)
+        && (x * (ConstExpression<double>(2) + ConstExpression<double>(3))).substitute("y", 1, true)->to_string() == "(x * 5)";
+    if (incremental_ok)
+        std::cout << "Test PASSED\n";
+    else
+        std::cout << "Test FAILED\n";
+
+    std::cout << "Testing real-domain evaluation and constant powers...\n";
+    using Complex = std::complex<double>;
+    Parser<double> real_parser;
+    Parser<Complex> complex_parser;
+    bool real_ok = Elementary<double>::power(3, 5) == 243 && Elementary<double>::power(2, -3) == 0.125
+        && Elementary<double>::power(1.5, 0.5) == std::pow(1.5, 0.5)
+        && Elementary<Complex>::power(Complex(-8), 3) == Complex(-512) && Elementary<Complex>::log(Complex(-1)).imag() != 0;
+    std::string power_cache = (std::filesystem::temp_directory_path() / ("symbolic-jit-power-" + std::to_string(getpid()))).string();
+    JitCompiler<double> real_jit(power_cache);
+    JitCompiler<Complex> complex_jit(power_cache);
+    // Batch, incremental and native evaluation must agree bit for bit with eval().
+    auto evaluators_agree = [](const auto& expr, const auto& bindings, auto value, auto& jit) {
+        using V = decltype(value);
+        auto tape = expr->compile();
+        std::vector<const V*> column_pointers;
+        for (const std::string& name : tape.variables)
+            column_pointers.push_back(&bindings.at(name));
+        V batch_value;
+        tape.eval_batch(column_pointers.data(), &batch_value, 1);
+        IncrementalEvaluator<V> incremental(*expr);
+        incremental.set(Environment<V>(bindings));
+        return batch_value == value && incremental.eval() == value && jit.compile(tape)(bindings) == value;
+    };
+    try {
+        for (const char* source : { "x 2 ^", "x 0.25 ^ y 3 ^ /", "x 0.5 ^ y sin +", "x ln y exp * x cos /", "x y ^ 2 ^" }) {
+            auto real_expr = real_parser.parse(source);
+            auto complex_expr = complex_parser.parse(source);
+            std::unordered_map<std::string, double> real_env{ { "x", 1.3 }, { "y", 2.2 } };
+            std::unordered_map<std::string, Complex> complex_env{ { "x", 1.3 }, { "y", 2.2 } };
+            Complex complex_value = complex_expr->eval(complex_env);
+            double real_value = real_expr->eval(real_env);
+            std::unordered_map<std::string, double> real_partials;
+            std::unordered_map<std::string, Complex> complex_partials;
+            real_ok = real_ok && complex_value.real() == real_value && complex_value.imag() == 0
+                && real_expr->compile().eval(real_env) == real_value && complex_expr->compile().eval(complex_env) == complex_value
+                && real_expr->gradient(real_env, real_partials) == real_value
+                && complex_expr->gradient(complex_env, complex_partials) == complex_value
+                && complex_partials["x"].real() == real_partials["x"] && complex_partials["y"].real() == real_partials["y"]
+                && evaluators_agree(real_expr, real_env, real_value, real_jit) && evaluators_agree(complex_expr, complex_env, complex_value, complex_jit);
+        }
+    }
+    catch (const std::runtime_error& e) {
+        std::cout << e.what() << '\n';
+        real_ok = false;
+    }
+    std::filesystem::remove_all(power_cache);
+    std::unordered_map<std::string, double> power_env{ { "x", 1.3 }, { "y", 2.2 } };
+    auto static_power = (sx ^ 0.25) / (sy ^ 3.0);
+    real_ok = real_ok && static_power(1.3, 2.2) == real_parser.parse("x 0.25 ^ y 3 ^ /")->eval(power_env)
+        && static_power(Complex(1.3), Complex(2.2)) == Complex(static_power(1.3, 2.2))
+        && (sx ^ 2.0)(1.3) == real_parser.parse("x 2 ^")->eval(power_env)
+        && (sx ^ 2.0)(Complex(1e200)) == Complex(std::numeric_limits<double>::infinity());
+    // Results that are not finite in double are redone in complex, as the CLI does.
+    struct Fallback {
+        const char* source;
+        double x;
+    };
+    for (Fallback fallback : { Fallback{ "x 2 ^", 1e200 }, Fallback{ "x 4 ^", -1e100 }, Fallback{ "x 3 ^", -1e200 }, Fallback{ "x 5 ^", -1e100 } }) {
+        std::unordered_map<std::string, double> real_env{ { "x", fallback.x } };
+        std::unordered_map<std::string, Complex> complex_env{ { "x", fallback.x } };
+        double real_value = real_parser.parse(fallback.source)->eval(real_env);
+        auto complex_expr = complex_parser.parse(fallback.source);
+        Complex complex_value = complex_expr->eval(complex_env);
+        real_ok = real_ok && std::isinf(real_value) && complex_value == Complex(real_value)
+            && complex_expr->compile().eval(complex_env) == complex_value;
+    }
+    std::unordered_map<std::string, double> negative_env{ { "x", -4 } };
+    std::unordered_map<std::string, Complex> negative_complex_env{ { "x", -4 } };
+    Complex root = complex_parser.parse("x 0.5 ^")->eval(negative_complex_env);
+    real_ok = real_ok && std::isnan(real_parser.parse("x 0.5 ^")->eval(negative_env))
+        && std::abs(root.real()) < 1e-15 && std::abs(root.imag() - 2) < 1e-15;
+    if (real_ok)
+        std::cout << "Test PASSED\n";
+    else
+        std::cout << "Test FAILED\n";
+
+    std::cout << "Testing deep expressions...\n";
+    // Deep enough that a recursive walk would overflow the default stack.
+    const size_t deep_levels = 50000;
+    std::string deep_source = "x";
+    for (size_t i = 0; i < deep_levels; i++)
+        deep_source += i % 2 ? " y *" : " 1 +";
+    bool deep_ok = true;
+    {
+        Parser<double> deep_parser;
+        auto deep = deep_parser.parse(deep_source);
+        std::unordered_map<std::string, double> deep_env{ { "x", 0.5 }, { "y", 1.0 } };
+        double deep_value = deep->eval(deep_env);
+        std::string deep_text = deep->to_string();
+        std::unordered_map<std::string, double> deep_partials;
+        auto deep_folded = deep->substitute("y", 1.0)->substitute("x", 0.5, true);
+        deep_ok = deep_value == 0.5 + deep_levels / 2 && deep->shape().depth == deep_levels + 1
+            && deep_text.size() == 6 * deep_levels + 1 && deep_text.compare(0, 6, "((((((") == 0
+            && deep->compile().eval(deep_env) == deep_value
+            && deep->gradient(deep_env, deep_partials) == deep_value && deep_partials["x"] == 1
+            && deep->differentiate("x")->simplify()->eval(deep_env) == 1
+            && ConstExpression<double>::match(deep_folded) && deep_folded->eval(deep_env) == deep_value;
+        std::shared_ptr<Expression<double>> negations = std::make_shared<VariableExpression<double>>("x");
+        for (size_t i = 0; i < deep_levels; i++)
+            negations = std::make_shared<UnaryOperationExpression<double>>(UnaryOperationExpression<double>::INV, negations);
+        deep_ok = deep_ok && negations->eval(deep_env) == 0.5;
+    }
+    if (deep_ok)
+        std::cout << "Test PASSED\n";
+    else
+        std::cout << "Test FAILED\n";
     return 0;
 }